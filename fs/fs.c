@@ -75,6 +75,30 @@ void write_block(u_int blockno) {
 	ide_write(0, blockno * SECT2BLK, va, SECT2BLK);
 }
 
+// Overview:
+//  Load the whole group of blocks that shares a superpage with 'blockno', using a single
+//  superpage allocation and a single disk read. Only done when none of them is in memory yet.
+//
+// Post-Condition:
+//  Return 0 if the group was loaded, or a negative error code, in which case the caller loads
+//  'blockno' alone.
+static int read_block_group(u_int blockno) {
+	u_int nblk = HUGE_PAIR_SIZE / BLOCK_SIZE;
+	u_int first = ROUNDDOWN(blockno, nblk);
+
+	if (super == NULL || first + nblk > super->s_nblocks) {
+		return -E_INVAL;
+	}
+	for (u_int b = first; b < first + nblk; b++) {
+		if (block_is_mapped(b)) {
+			return -E_INVAL;
+		}
+	}
+	try(syscall_mem_alloc(0, disk_addr(first), PTE_D | PTE_HUGE));
+	ide_read(0, first * SECT2BLK, disk_addr(first), nblk * SECT2BLK);
+	return 0;
+}
+
 // Overview:
 //  Make sure a particular disk block is loaded into memory.
 //
@@ -121,8 +145,10 @@ int read_block(u_int blockno, void **blk, u_int *isnew) {
 		if (isnew) {
 			*isnew = 1;
 		}
-		try(syscall_mem_alloc(0, va, PTE_D));
-		ide_read(0, blockno * SECT2BLK, va, SECT2BLK);
+		if (read_block_group(blockno) != 0) {
+			try(syscall_mem_alloc(0, va, PTE_D));
+			ide_read(0, blockno * SECT2BLK, va, SECT2BLK);
+		}
 	}
 
 	// Step 5: if blk != NULL, assign 'va' to '*blk'.
@@ -157,13 +183,14 @@ void unmap_block(u_int blockno) {
 	// Step 2: If this block is used (not free) and dirty in cache, write it back to the disk
 	// first.
 	// Hint: Use 'block_is_free', 'block_is_dirty' to check, and 'write_block' to sync.
+	// Clients that map the block may have written to it without telling us yet.
 	/* Exercise 5.7: Your code here. (4/5) */
-	if (!block_is_free(blockno) && block_is_dirty(blockno)) {
+	if (!block_is_free(blockno) && (block_is_dirty(blockno) || pageref(va) > 1)) {
 		write_block(blockno);
 	}
-	// Step 3: Unmap the virtual address via syscall.
+	// Step 3: Unmap the virtual address via syscall, from the clients that map it as well.
 	/* Exercise 5.7: Your code here. (5/5) */
-	syscall_mem_unmap(env->env_id, va);
+	syscall_mem_revoke(va);
 	user_assert(!block_is_mapped(blockno));
 }
 
@@ -7,13 +7,6 @@
 #define SECT_SIZE 512			  /* Bytes per disk sector */
 #define SECT2BLK (BLOCK_SIZE / SECT_SIZE) /* sectors to a block */
 
-/* Disk block n, when in memory, is mapped into the file system
- * server's address space at DISKMAP+(n*BLOCK_SIZE). */
-#define DISKMAP 0x10000000
-
-/* Maximum disk size we can handle (1GB) */
-#define DISKMAX 0x40000000
-
 /* ide.c */
 void ide_read(u_int diskno, u_int secno, void *dst, u_int nsecs);
 void ide_write(u_int diskno, u_int secno, void *src, u_int nsecs);
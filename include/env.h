@@ -1,6 +1,7 @@
 #ifndef _ENV_H_
 #define _ENV_H_
 
+#include <lazy.h>
 #include <mmu.h>
 #include <queue.h>
 #include <trap.h>
@@ -15,17 +16,51 @@
 #define ENV_RUNNABLE 1
 #define ENV_NOT_RUNNABLE 2
 
+// Scheduling classes ('env_sched_class'). Runnable envs of the priority class always run
+// before those of the fair class.
+#define ENV_SCHED_FAIR 0 // the env with the least 'env_vruntime' runs, see 'sched_charge'
+#define ENV_SCHED_PRIO 1 // run queues by priority level, see 'struct Sched_array'
+
+// Priorities ('env_pri'). In the fair class, an env gets CPU time in proportion to 'env_pri'.
+// In the priority class, each round of the scheduler, an env runs for 'env_pri' ticks, and the
+// envs of a higher priority run first. Priorities from 'ENV_NPRI - 1' up share the top level.
+// An env serving requests runs at the priority of the highest env waiting for it if that's
+// higher than its own, see 'sched_pri'.
+#define ENV_NPRI 32
+#define ENV_PRI_DEFAULT 1     // envs created by the kernel, and commands run by the shell
+#define ENV_PRI_INTERACTIVE 2 // the shell, and the envs starting it, see init/init.c
+#define ENV_PRI_SERVER 4      // the file system server, see 'ENV_CREATE_FS'
+
+LIST_HEAD(Env_list, Env);
+
+// The exit status of a child whose parent wasn't waiting for it, kept until the parent gets it
+// with 'sys_wait' or exits itself.
+struct Env_exit {
+	LIST_ENTRY(Env_exit) ee_link;
+	u_int ee_id;   // envid of the child
+	int ee_status; // its exit status
+};
+LIST_HEAD(Env_exit_list, Env_exit);
+
 // Control block of an environment (process).
 struct Env {
 	struct Trapframe env_tf;	 // saved context (registers) before switching
 	LIST_ENTRY(Env) env_link;	 // intrusive entry in 'env_free_list'
 	u_int env_id;			 // unique environment identifier
-	u_int env_asid;			 // ASID of this env
+	u_int env_asid;			 // ASID of this env, see 'ASID_GEN'
 	u_int env_parent_id;		 // env_id of this env's parent
 	u_int env_status;		 // status of this env
 	Pde *env_pgdir;			 // page directory
-	TAILQ_ENTRY(Env) env_sched_link; // intrusive entry in 'env_sched_list'
+	TAILQ_ENTRY(Env) env_sched_link; // intrusive entry in a run queue, see 'sched_insert'
+	struct Sched_array *env_runq;	 // priority run queues it's on, NULL if none
+	u_int env_fair_idx;		 // index in the fair class heap, 0 if not in it
+	u_int env_sched_class;		 // 'ENV_SCHED_FAIR' or 'ENV_SCHED_PRIO'
 	u_int env_pri;			 // schedule priority
+	u_int env_inh_pri;		 // highest priority of 'env_waiters', 0 if none
+	int env_slice;			 // ticks left this round in the priority class, see 'schedule'
+	struct Env *env_waiting;	 // env serving our request, see 'sched_wait'
+	LIST_ENTRY(Env) env_waiter_link; // intrusive entry in the 'env_waiters' of 'env_waiting'
+	struct Env_list env_waiters;	 // envs waiting for us to serve their requests
 
 	// Lab 4 IPC
 	u_int env_ipc_value;   // the value sent to us
@@ -33,24 +68,44 @@ struct Env {
 	u_int env_ipc_recving; // whether this env is blocked receiving
 	u_int env_ipc_dstva;   // va at which the received page should be mapped
 	u_int env_ipc_perm;    // perm in which the received page should be mapped
+	u_int env_ipc_handoff; // whether the sender switches straight to us, see 'sys_ipc_call'
 
 	// Lab 4 fault handling
 	u_int env_user_tlb_mod_entry; // userspace TLB Mod handler
+	u_int env_user_pgfault_entry; // userspace handler of faults on unmapped pages in
+	u_int env_user_pgfault_lo;    // [env_user_pgfault_lo, env_user_pgfault_hi)
+	u_int env_user_pgfault_hi;
+
+	struct Lazy_seg_list env_lazy_segs; // ELF segments whose pages are filled in on first touch
+	u_int env_template;		    // whether this env is a frozen image for 'sys_env_clone'
+	u_int env_disk;		    // whether it drives the IDE disk itself, see 'sys_read_dev'
+	u_int env_fs;			    // whether it's the file system server, see 'env_init_fs'
+	u_int env_sched_priv;		    // whether it may raise priorities, set by the kernel only
 
 	// Lab 6 scheduler counts
-	u_int env_runs; // number of times we've been env_run'ed
+	u_int env_runs;        // number of times we've been env_run'ed
+	uint64_t env_runtime;  // CPU cycles used, see 'sched_charge'
+	uint64_t env_vruntime; // 'env_runtime' weighted by 'env_pri', in the fair class
 	int env_exit_status;
+
+	// Lab 6 waiting for children
+	u_int env_nchild;               // number of children alive
+	struct Env_exit_list env_exits; // children that exited and weren't waited for yet
+	u_int env_wait_recving;         // whether this env is blocked in 'sys_wait'
+	u_int env_wait_id;              // envid of the child it waits for, 0 for any
+	int env_wait_status;            // exit status of the child 'sys_wait' returned
 };
 
-LIST_HEAD(Env_list, Env);
 TAILQ_HEAD(Env_sched_list, Env);
 extern struct Env *curenv;		     // the current env
-extern struct Env_sched_list env_sched_list; // runnable env list
+extern u_int asid_generation;		     // generation of the ASIDs handed out now
 
 void env_init(void);
 int env_alloc(struct Env **e, u_int parent_id);
 void env_free(struct Env *);
+int env_dup_vm(struct Env *child, struct Env *parent);
 struct Env *env_create(const void *binary, size_t size, int priority);
+void env_init_fs(struct Env *e);
 void env_destroy(struct Env *e);
 
 int envid2env(u_int envid, struct Env **penv, int checkperm);
@@ -70,7 +125,14 @@ void envid2env_check(void);
 	({                                                                                         \
 		extern u_char binary_##x##_start[];                                                \
 		extern u_int binary_##x##_size;                                                    \
-		env_create(binary_##x##_start, (u_int)binary_##x##_size, 1);                       \
+		env_create(binary_##x##_start, (u_int)binary_##x##_size, ENV_PRI_DEFAULT);         \
+	})
+
+#define ENV_CREATE_FS(x)                                                                           \
+	({                                                                                         \
+		struct Env *_e = ENV_CREATE_PRIORITY(x, ENV_PRI_SERVER);                           \
+		env_init_fs(_e);                                                                   \
+		_e;                                                                                \
 	})
 
 #endif // !_ENV_H_
@@ -0,0 +1,45 @@
+#ifndef _KMALLOC_H_
+#define _KMALLOC_H_
+
+#include <pmap.h>
+#include <queue.h>
+#include <types.h>
+
+LIST_HEAD(Slab_list, Slab);
+
+/* A slab is a buddy block of 2^kc_order pages cut into objects of one size class. Its header
+ * sits at the start of the block, followed by the objects. */
+struct Slab {
+	LIST_ENTRY(Slab) sl_link; // link in one of the lists of its cache
+	struct Kmem_cache *sl_cache;
+	void *sl_free; // first free object, each free object holds the next one
+	u_int sl_inuse;
+};
+
+struct Kmem_cache {
+	const char *kc_name;
+	u_int kc_size;		     // size of every object
+	u_int kc_order;		     // each slab spans 2^kc_order pages
+	struct Slab_list kc_partial; // slabs with both used and free objects
+	struct Slab_list kc_full;    // slabs with no free object left
+	struct Slab_list kc_empty;   // slabs kept for reuse, at most KMEM_EMPTY_MAX
+
+	// statistics
+	u_int kc_nslab;	 // slabs currently owned by the cache
+	u_int kc_nempty; // slabs on 'kc_empty'
+	u_int kc_inuse;	 // objects currently handed out
+	u_long kc_nalloc;
+	u_long kc_nfree;
+};
+
+// Requests larger than this get whole buddy blocks instead of slab objects.
+#define KMALLOC_MAX_SLAB 2048
+#define KMEM_EMPTY_MAX 1
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+u_long kmalloc_npage(void);
+void kmalloc_info(void);
+void kmalloc_check(void);
+
+#endif /* _KMALLOC_H_ */
@@ -0,0 +1,29 @@
+#ifndef _KSM_H_
+#define _KSM_H_
+
+#include <pmap.h>
+#include <syscall.h>
+
+// Buckets of the table of page hashes the scanner looks duplicates up in.
+#define KSM_NBUCKET 1024
+
+#if !defined(LAB) || LAB >= 4
+extern u_int ksm_batch;
+
+void ksm_scan(u_int n);
+void ksm_idle(void);
+void ksm_unmerge(struct Page *pp);
+void ksm_info(struct Ksm_info *info);
+#else
+// No merging before the COW lab: nothing would resolve a write to a merged page.
+static inline void ksm_scan(u_int n) {
+}
+
+static inline void ksm_idle(void) {
+}
+
+static inline void ksm_unmerge(struct Page *pp) {
+}
+#endif
+
+#endif /* _KSM_H_ */
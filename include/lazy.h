@@ -0,0 +1,31 @@
+#ifndef _LAZY_H_
+#define _LAZY_H_
+
+#include <queue.h>
+#include <types.h>
+
+struct Env;
+struct Page;
+
+// A loadable ELF segment whose pages are only filled in when they are first touched.
+struct Lazy_seg {
+	LIST_ENTRY(Lazy_seg) ls_link; // intrusive entry in 'env_lazy_segs'
+	u_long ls_va;		      // first byte of the segment
+	u_long ls_memsz;	      // size of the segment in memory
+	u_long ls_filesz;	      // bytes coming from the file, the rest is zero
+	u_int ls_perm;		      // permission of its pages
+	u_int ls_off;		      // offset of the file data in 'ls_pages[0]'
+	u_int ls_npage;		      // number of pages in 'ls_pages'
+	struct Page **ls_pages;	      // copy of the file data, referenced by the segment
+};
+
+LIST_HEAD(Lazy_seg_list, Lazy_seg);
+
+struct Lazy_seg *lazy_seg_alloc(u_long va, u_long memsz, u_long filesz, u_int perm, u_int off);
+void lazy_seg_free(struct Lazy_seg *ls);
+void lazy_seg_insert(struct Env *e, struct Lazy_seg *ls);
+void lazy_seg_free_all(struct Env *e);
+int lazy_seg_dup(struct Env *child, struct Env *parent);
+int lazy_fault(struct Env *e, u_long va);
+
+#endif /* _LAZY_H_ */
@@ -32,6 +32,8 @@
 #define MALTA_IDE_STATUS (MALTA_IDE_BASE + 0x07)
 #define MALTA_IDE_LBA 0xE0
 #define MALTA_IDE_BUSY 0x80
+#define MALTA_IDE_DRQ 0x08   /* A data transfer is in progress */
+#define MALTA_IDE_ERROR 0x01 /* The last command failed */
 #define MALTA_IDE_CMD_PIO_READ 0x20  /* Read sectors with retry */
 #define MALTA_IDE_CMD_PIO_WRITE 0x30 /* write sectors with retry */
 
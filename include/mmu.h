@@ -6,6 +6,11 @@
  */
 
 #define NASID 256
+#define NTLB 16 // entry pairs in the 4Kc TLB
+
+// 'env_asid' holds the hardware ASID in its low bits and the generation it belongs to above them.
+#define ASID_GEN_SHIFT 8
+#define ASID_GEN(asid) ((asid) >> ASID_GEN_SHIFT)
 #define PAGE_SIZE 4096
 #define PTMAP PAGE_SIZE
 #define PDMAP (4 * 1024 * 1024) // bytes mapped by a page directory entry
@@ -65,6 +70,25 @@
 // Shared memmory. Reserved for software, used by fork.
 #define PTE_LIBRARY 0x0002
 
+// Superpage. Reserved for software, set only by the kernel on all 'HUGE_PAIR_NPTE' entries of an
+// aligned range whose two halves are physically contiguous: the TLB refill then maps the whole
+// range with a single entry pair of 64 KiB pages.
+#define PTE_HUGE 0x0008
+
+// Swapped out. Reserved for software, set only by the kernel on entries without 'PTE_V': the
+// page lives in the swap slot numbered by the PPN field, and the other bits are kept as they
+// were so that it comes back with the same permission.
+#define PTE_SWAP 0x0010
+#define PTE_IS_SWAP(pte) (((pte) & (PTE_V | PTE_SWAP)) == PTE_SWAP)
+
+// Superpage geometry, with CP0 PageMask set to 'PAGEMASK_HUGE' for each half of an entry pair.
+#define HUGE_PGSHIFT 16
+#define HUGE_PAGE_SIZE (1 << HUGE_PGSHIFT)
+#define HUGE_PAIR_SIZE (2 * HUGE_PAGE_SIZE)
+#define HUGE_PAIR_NPTE (HUGE_PAIR_SIZE / PAGE_SIZE)
+#define HUGE_PAIR_ORDER (HUGE_PGSHIFT + 1 - PGSHIFT) // buddy order of a whole range
+#define PAGEMASK_HUGE 0x1e000
+
 // Memory segments (32-bit kernel mode addresses)
 #define KUSEG 0x00000000U
 #define KSEG0 0x80000000U
@@ -78,7 +102,9 @@
 /*
  o     4G ----------->  +----------------------------+------------0x100000000
  o                      |       ...                  |  kseg2
- o      KSEG2    -----> +----------------------------+------------0xc000 0000
+ o                      +----------------------------+------------
+ o                      |  Highmem Temporary Maps    |  KMAP_NSLOT * 2 * PAGE_SIZE
+ o   KSEG2,KMAP_BASE -> +----------------------------+------------0xc000 0000
  o                      |          Devices           |  kseg1
  o      KSEG1    -----> +----------------------------+------------0xa000 0000
  o                      |      Invalid Memory        |   /|\
@@ -93,16 +119,16 @@
  o      ULIM     -----> +----------------------------+------------0x8000 0000-------
  o                      |         User VPT           |     PDMAP                /|\
  o      UVPT     -----> +----------------------------+------------0x7fc0 0000    |
- o                      |           pages            |     PDMAP                 |
- o      UPAGES   -----> +----------------------------+------------0x7f80 0000    |
+ o                      |           pages            |     UPAGES_SIZE           |
+ o      UPAGES   -----> +----------------------------+------------0x7ec0 0000    |
  o                      |           envs             |     PDMAP                 |
- o  UTOP,UENVS   -----> +----------------------------+------------0x7f40 0000    |
+ o  UTOP,UENVS   -----> +----------------------------+------------0x7e80 0000    |
  o  UXSTACKTOP -/       |     user exception stack   |     PTMAP                 |
- o                      +----------------------------+------------0x7f3f f000    |
+ o                      +----------------------------+------------0x7e7f f000    |
  o                      |                            |     PTMAP                 |
- o      USTACKTOP ----> +----------------------------+------------0x7f3f e000    |
+ o      USTACKTOP ----> +----------------------------+------------0x7e7f e000    |
  o                      |     normal user stack      |     PTMAP                 |
- o                      +----------------------------+------------0x7f3f d000    |
+ o                      +----------------------------+------------0x7e7f d000    |
  a                      |                            |                           |
  a                      ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                           |
  a                      .                            .                           |
@@ -125,8 +151,11 @@
 #define KSTACKTOP (ULIM + PDMAP)
 #define ULIM 0x80000000
 
+// Room for the 'struct Page' of every page of the largest RAM Malta takes (2 GiB).
+#define UPAGES_SIZE (4 * PDMAP)
+
 #define UVPT (ULIM - PDMAP)
-#define UPAGES (UVPT - PDMAP)
+#define UPAGES (UVPT - UPAGES_SIZE)
 #define UENVS (UPAGES - PDMAP)
 
 #define UTOP UENVS
@@ -147,6 +176,15 @@
 #include <types.h>
 
 extern u_long npage;
+extern u_long npage_low;
+
+/* Only the RAM below the I/O hole at 256 MiB (the 'ram_low_size' bytes given by the bootloader)
+ * is reachable through KSEG0. Malta shows the whole RAM again at 'HIGHMEM_PA_BASE', which is
+ * where the pages beyond it (highmem) are mapped from, see 'page2pa' and 'kmap'. */
+#define HIGHMEM_PA_BASE 0x80000000U
+
+// The number of the physical page at 'pa', i.e. its index in 'pages', highmem included.
+#define PA2PPN(pa) PPN((u_long)(pa) >= HIGHMEM_PA_BASE ? (u_long)(pa) - HIGHMEM_PA_BASE : (pa))
 
 typedef u_long Pde;
 typedef u_long Pte;
@@ -159,11 +197,11 @@ typedef u_long Pte;
 		_a - ULIM;                                                                         \
 	})
 
-// translates from physical address to kernel virtual address
+// translates from physical address to kernel virtual address, for memory below highmem only
 #define KADDR(pa)                                                                                  \
 	({                                                                                         \
 		u_long _ppn = PPN(pa);                                                             \
-		if (_ppn >= npage) {                                                               \
+		if (_ppn >= npage_low) {                                                           \
 			panic("KADDR called with invalid pa %08lx", (u_long)pa);                   \
 		}                                                                                  \
 		(pa) + ULIM;                                                                       \
@@ -182,7 +220,16 @@ typedef u_long Pte;
 		(u_int) __m_p > ULIM ? (typeof(_p))ULIM : __m_p;                                   \
 	})
 
-extern void tlb_out(u_int entryhi);
+extern int tlb_out(u_int entryhi);
+extern void tlb_flush_all(void);
+extern void tlb_flush_asid(u_int asid);
+extern void tlb_flush_pa(u_long pa);
+extern void tlb_set_wired(u_int n);
+extern void tlb_write_wired(u_int index, u_long entryhi, u_long entrylo0, u_long entrylo1);
 void tlb_invalidate(u_int asid, u_long va);
+void tlb_invalidate_asid(u_int asid);
+int tlb_invalidate_used(u_int asid, u_long va);
+extern u_int tlb_refill_fast;
+extern u_int tlb_refill_slow;
 #endif //!__ASSEMBLER__
 #endif // !_MMU_H_
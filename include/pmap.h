@@ -4,6 +4,7 @@
 #include <mmu.h>
 #include <printk.h>
 #include <queue.h>
+#include <syscall.h>
 #include <types.h>
 
 extern Pde *cur_pgdir;
@@ -11,35 +12,112 @@ extern Pde *cur_pgdir;
 LIST_HEAD(Page_list, Page);
 typedef LIST_ENTRY(Page) Page_LIST_entry_t;
 
+LIST_HEAD(Rmap_list, Rmap);
+
 struct Page {
-	Page_LIST_entry_t pp_link; /* free list link */
+	Page_LIST_entry_t pp_link; /* free list link, or merged page list link (see 'PP_KSM') */
 
 	// Ref is the count of pointers (usually in page table entries)
 	// to this page.  This only holds for pages allocated using
 	// page_alloc.  Pages allocated at boot time using pmap.c's "alloc"
 	// do not have valid reference count fields.
 
-	u_short pp_ref;
+	u_int pp_ref;
+
+	// Buddy allocator state. 'pp_order' is the order of the block this page belongs to,
+	// valid while one of 'PP_FREE', 'PP_SLAB' or 'PP_KLARGE' is set in 'pp_flags'.
+	u_char pp_order;
+	u_char pp_flags;
+
+	// Entries in use (non-zero) in this page if it's a page table, see 'page_unmap'. Otherwise
+	// the number of page table entries mapping it, see 'pte_set'.
+	u_short pp_npte;
+
+	// If it's a page table, how many of its entries are swapped out, map a page copy-on-write,
+	// and map a page that's mapped elsewhere too, see 'pte_set' and 'mem_stat'.
+	u_short pp_nswap;
+	u_short pp_ncow;
+	u_short pp_nshared;
+
+	// The page table entries mapping this page, see 'struct Rmap'.
+	struct Rmap_list pp_rmap;
+};
+
+/* A reverse mapping: the page at 'rm_va' in 'rm_pgdir' maps the 'struct Page' on whose
+ * 'pp_rmap' list this entry is. Every mapping made by 'page_insert' has one, except those of
+ * the zero page, so that a page can be unmapped from every address space at once. */
+struct Rmap {
+	LIST_ENTRY(Rmap) rm_link;
+	Pde *rm_pgdir;
+	u_long rm_va;
+};
+
+// Highmem pages are reached by the kernel through wired TLB entries, one per 'kmap' in use.
+#define KMAP_BASE KSEG2
+#define KMAP_NSLOT 4
+
+// Reverse mappings are taken from a pool sized at boot, 'RMAP_PER_PAGE' per physical page,
+// which grows by 'RMAP_GROW' at a time from 'kmalloc' when it runs out.
+#define RMAP_PER_PAGE 2
+#define RMAP_GROW 64
+
+#define PP_FREE 0x1     // heads a block on one of the free lists
+#define PP_ZERO 0x2     // sits in the pre-zeroed page pool
+#define PP_SLAB 0x4     // part of a kmalloc slab
+#define PP_KLARGE 0x8   // heads a block returned by kmalloc for a large request
+#define PP_KSM 0x10     // shared by equal user pages merged by 'ksm_scan', mapped copy-on-write
+#define PP_PGTABLE 0x20 // page directory or page table of an env, see 'page_set_pgtable'
+
+// Free blocks hold 2^order contiguous pages, with 0 <= order <= PAGE_MAX_ORDER.
+#define PAGE_MAX_ORDER 10
+
+// Pages zeroed ahead of time while the system is idle, handed out first by 'page_alloc'.
+#define PAGE_ZERO_POOL_MAX 64
+#define PAGE_ZERO_REFILL_BATCH 8
+
+struct Page_free_area {
+	struct Page_list pf_list[PAGE_MAX_ORDER + 1]; // free blocks of each order
+	u_long pf_npage;			      // free pages across all orders
+	struct Page_list pf_zero;		      // pre-zeroed single pages
+	u_long pf_nzero;			      // pages in 'pf_zero'
 };
 
 extern struct Page *pages;
-extern struct Page_list page_free_list;
+extern struct Page_free_area page_free_area;
+extern struct Page *zero_page;
 
 static inline u_long page2ppn(struct Page *pp) {
 	return pp - pages;
 }
 
+// Highmem pages are mapped from the alias of the whole RAM, see 'HIGHMEM_PA_BASE'.
 static inline u_long page2pa(struct Page *pp) {
-	return page2ppn(pp) << PGSHIFT;
+	u_long ppn = page2ppn(pp);
+
+	return ppn < npage_low ? ppn << PGSHIFT : HIGHMEM_PA_BASE + (ppn << PGSHIFT);
 }
 
 static inline struct Page *pa2page(u_long pa) {
-	if (PPN(pa) >= npage) {
+	if (PA2PPN(pa) >= npage) {
 		panic("pa2page called with invalid pa: %x", pa);
 	}
-	return &pages[PPN(pa)];
+	return &pages[PA2PPN(pa)];
+}
+
+extern u_long pgtable_npage;
+
+// Count 'pp' as a page directory or page table until it's freed.
+static inline void page_set_pgtable(struct Page *pp) {
+	pp->pp_flags |= PP_PGTABLE;
+	pp->pp_nswap = pp->pp_ncow = pp->pp_nshared = 0;
+	pgtable_npage++;
+}
+
+static inline int page_is_highmem(struct Page *pp) {
+	return page2ppn(pp) >= npage_low;
 }
 
+// Only for pages below highmem, use 'kmap' for the others.
 static inline u_long page2kva(struct Page *pp) {
 	return KADDR(page2pa(pp));
 }
@@ -59,21 +137,45 @@ static inline u_long va2pa(Pde *pgdir, u_long va) {
 }
 
 void mips_detect_memory(u_int _memsize);
+void mips_detect_highmem(char **penv);
 void mips_vm_init(void);
 void mips_init(u_int argc, char **argv, char **penv, u_int ram_low_size);
 void page_init(void);
 void *alloc(u_int n, u_int align, int clear);
 
+int page_alloc_pages(struct Page **pp, u_int order);
+void page_free_pages(struct Page *pp, u_int order);
+void page_free_area_steal(struct Page_free_area *saved);
+void page_free_area_restore(struct Page_free_area *saved);
 int page_alloc(struct Page **pp);
+int page_alloc_nozero(struct Page **pp);
+int page_alloc_user(struct Page **pp);
+int page_alloc_user_nozero(struct Page **pp);
+void *kmap(struct Page *pp);
+void kunmap(void *va);
+void mem_stat(Pde *pgdir, u_long va, u_long len, struct Mem_stat *st);
+void pte_set(Pte *pte, Pte val);
 void page_free(struct Page *pp);
+void page_zero_refill(u_int n);
+struct Page *zero_page_get(void);
 void page_decref(struct Page *pp);
 int page_insert(Pde *pgdir, u_int asid, struct Page *pp, u_long va, u_int perm);
 struct Page *page_lookup(Pde *pgdir, u_long va, Pte **ppte);
 void page_remove(Pde *pgdir, u_int asid, u_long va);
+void page_unmap(Pde *pgdir, u_int asid, u_long va);
+int page_promote(Pde *pgdir, u_int asid, u_long va);
+int page_rmap_add(struct Page *pp, Pde *pgdir, u_long va);
+void page_rmap_remove(struct Page *pp, Pde *pgdir, u_long va);
+int page_unmap_all(struct Page *pp);
 
 extern struct Page *pages;
 
 void physical_memory_manage_check(void);
 void page_check(void);
+void buddy_check(void);
+void superpage_check(void);
+void rmap_check(void);
+void pgtable_check(void);
+void highmem_check(void);
 
 #endif /* _PMAP_H_ */
@@ -1,6 +1,21 @@
 #ifndef __SCHED_H__
 #define __SCHED_H__
 
+#include <env.h>
+
+// The most CPU time (in CP0 Count cycles at priority 1) an env of the fair class is behind the
+// others when it wakes up, half a tick ('TIMER_INTERVAL'), see 'sched_insert'.
+#define SCHED_WAKEUP_CREDIT 250000
+
+void sched_init(void);
+void sched_insert(struct Env *e);
+void sched_remove(struct Env *e);
+u_int sched_pri(struct Env *e);
+void sched_set_pri(struct Env *e, u_int pri);
+void sched_set_class(struct Env *e, u_int class);
+void sched_wait(struct Env *e, struct Env *server);
+void sched_wait_drop(struct Env *e);
 void schedule(int yield) __attribute__((noreturn));
+void sched_handoff(struct Env *e) __attribute__((noreturn));
 
 #endif /* __SCHED_H__ */
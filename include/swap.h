@@ -0,0 +1,38 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <error.h>
+#include <mmu.h>
+
+// The swap area is the whole second IDE disk ('target/empty.img', see fs/Makefile).
+#define SWAP_DISKNO 1
+#define SWAP_NSLOT 1024
+#define SWAP_SECT_SIZE 512
+#define SWAP_SECT_PER_PAGE (PAGE_SIZE / SWAP_SECT_SIZE)
+
+#if !defined(LAB) || LAB >= 5
+extern u_long swap_nout;
+extern u_long swap_nin;
+
+int swap_out(void);
+int swap_in(Pde *pgdir, u_int asid, u_long va);
+void swap_dup(Pte pte);
+void swap_free(Pte pte);
+#else
+// No swap before the file system lab: the disk isn't there yet.
+static inline int swap_out(void) {
+	return -E_NO_MEM;
+}
+
+static inline int swap_in(Pde *pgdir, u_int asid, u_long va) {
+	return 0;
+}
+
+static inline void swap_dup(Pte pte) {
+}
+
+static inline void swap_free(Pte pte) {
+}
+#endif
+
+#endif /* _SWAP_H_ */
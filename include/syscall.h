@@ -3,6 +3,8 @@
 
 #ifndef __ASSEMBLER__
 
+#include <types.h>
+
 enum {
 	SYS_putchar,
 	SYS_print_cons,
@@ -23,9 +25,73 @@ enum {
 	SYS_write_dev,
 	SYS_read_dev,
 	SYS_exit,
+	SYS_fork,
+	SYS_mem_batch,
+	SYS_lazy_seg,
+	SYS_env_template,
+	SYS_env_clone,
+	SYS_set_pgfault_entry,
+	SYS_mem_revoke,
+	SYS_ksm_ctl,
+	SYS_mem_stat,
+	SYS_set_env_pri,
+	SYS_set_env_sched,
+	SYS_ipc_call,
+	SYS_wait,
 	MAX_SYSNO,
 };
 
+// Operations of 'sys_mem_batch', in the low bits of 'mo_op'.
+#define MEM_OP_ALLOC 0	 // allocate fresh pages at 'mo_dstva' with 'mo_perm'
+#define MEM_OP_MAP 1	 // map the pages at 'mo_srcva' of 'mo_srcid' at 'mo_dstva' with 'mo_perm'
+#define MEM_OP_UNMAP 2	 // unmap the pages at 'mo_dstva'
+#define MEM_OP_PROTECT 3 // change the permission of the pages at 'mo_dstva' to 'mo_perm'
+#define MEM_OP_TYPE 0xf
+// Flags of 'sys_mem_batch', or'ed into 'mo_op'.
+#define MEM_OP_SKIP 0x10    // skip unmapped source pages instead of failing
+#define MEM_OP_KEEP 0x20    // use the source permission masked with 'mo_perm' as the permission
+#define MEM_OP_LIBRARY 0x40 // only apply to source pages with 'PTE_LIBRARY'
+
+#define MEM_BATCH_MAX 64 // max number of operations in a batch
+
+/* One operation of 'sys_mem_batch', applied to 'mo_npage' consecutive pages. */
+struct Mem_op {
+	u_int mo_op;
+	u_int mo_srcid;
+	u_int mo_srcva;
+	u_int mo_dstid;
+	u_int mo_dstva;
+	u_int mo_perm;
+	u_int mo_npage;
+	u_int mo_done; // set by the kernel: number of pages processed
+};
+
+/* The state of the same-page merging scanner, reported by 'sys_ksm_ctl'. */
+struct Ksm_info {
+	u_int ki_batch;	  // pages scanned each time the system is idle, 0 if it's off
+	u_int ki_shared;  // merged pages in use
+	u_int ki_sharing; // mappings of the merged pages
+	u_int ki_nzero;	  // pages found full of zeros and replaced by the zero page so far
+	u_int ki_nscan;	  // pages scanned so far
+};
+
+/* Memory usage, reported by 'sys_mem_stat'. The first part covers the whole system, the
+ * second the pages an env maps in the range it was asked about. */
+struct Mem_stat {
+	u_int ms_npage;	   // physical pages
+	u_int ms_nhighmem; // of which highmem, given to user space first
+	u_int ms_nfree;	   // free pages, pre-zeroed ones included
+	u_int ms_nzero;	   // free pages zeroed ahead of time
+	u_int ms_npgtable; // page directories and page tables of all envs
+	u_int ms_nkmalloc; // pages held by 'kmalloc'
+
+	u_int ms_nresident; // pages mapped
+	u_int ms_nshared;   // of which mapped more than once (by any env)
+	u_int ms_ncow;	    // of which mapped copy-on-write
+	u_int ms_nswap;	    // pages swapped out
+	u_int ms_nenvpgtable; // page tables covering the range, plus the page directory
+};
+
 #endif
 
 #endif
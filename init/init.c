@@ -42,13 +42,15 @@ void mips_init(u_int argc, char **argv, char **penv, u_int ram_low_size) {
 	printk("init.c:\tmips_init() is called\n");
 
 	mips_detect_memory(ram_low_size);
+	mips_detect_highmem(penv);
 	mips_vm_init();
 	page_init();
 
 	env_init();
 
-	ENV_CREATE(user_icode);
-	ENV_CREATE(fs_serv);
+	// the first env spawns init, which spawns the shell: they all run at this priority
+	ENV_CREATE_PRIORITY(user_icode, ENV_PRI_INTERACTIVE);
+	ENV_CREATE_FS(fs_serv);
 
 	schedule(0);
 
@@ -1,56 +1,44 @@
 #include <asm/cp0regdef.h>
 #include <elf.h>
 #include <env.h>
+#include <kmalloc.h>
+#include <lazy.h>
 #include <mmu.h>
 #include <pmap.h>
 #include <printk.h>
 #include <sched.h>
+#include <swap.h>
 
-struct Env envs[NENV] __attribute__((aligned(PAGE_SIZE))); // All environments
+struct Env envs[NENV] __attribute__((aligned(HUGE_PAGE_SIZE))); // All environments
 
 struct Env *curenv = NULL;	      // the current env
 static struct Env_list env_free_list; // Free list
 
-// Invariant: 'env' in 'env_sched_list' iff. 'env->env_status' is 'RUNNABLE'.
-struct Env_sched_list env_sched_list; // Runnable list
-
 static Pde *base_pgdir;
 
-static uint32_t asid_bitmap[NASID / 32] = {0};
+static u_int asid_next = 1; // hardware ASID 0 is left to the kernel's own mappings
 
 /* Overview:
- *  Allocate an unused ASID.
+ *  Make sure 'e' holds an ASID of the current generation, handing out the next unused hardware
+ *  ASID if it doesn't.
  *
  * Post-Condition:
- *   return 0 and set '*asid' to the allocated ASID on success.
- *   return -E_NO_FREE_ENV if no ASID is available.
+ *  When a generation runs out of hardware ASIDs, a new one starts and the whole TLB is flushed.
+ *  Every env still holding an ASID of an older generation then gets a new one the next time it
+ *  runs, so no two envs ever share a hardware ASID within a generation.
  */
-static int asid_alloc(u_int *asid) {
-	for (u_int i = 0; i < NASID; ++i) {
-		int index = i >> 5;
-		int inner = i & 31;
-		if ((asid_bitmap[index] & (1 << inner)) == 0) {
-			asid_bitmap[index] |= 1 << inner;
-			*asid = i;
-			return 0;
+static void asid_alloc(struct Env *e) {
+	if (ASID_GEN(e->env_asid) == asid_generation) {
+		return;
+	}
+	if (asid_next == NASID) {
+		if (++asid_generation == (1U << (32 - ASID_GEN_SHIFT))) {
+			asid_generation = 1;
 		}
+		asid_next = 1;
+		tlb_flush_all();
 	}
-	return -E_NO_FREE_ENV;
-}
-
-/* Overview:
- *  Free an ASID.
- *
- * Pre-Condition:
- *  The ASID is allocated by 'asid_alloc'.
- *
- * Post-Condition:
- *  The ASID is freed and may be allocated again later.
- */
-static void asid_free(u_int i) {
-	int index = i >> 5;
-	int inner = i & 31;
-	asid_bitmap[index] &= ~(1 << inner);
+	e->env_asid = (asid_generation << ASID_GEN_SHIFT) | asid_next++;
 }
 
 /* Overview:
@@ -76,6 +64,12 @@ static void map_segment(Pde *pgdir, u_int asid, u_long pa, u_long va, u_int size
 		/* Exercise 3.2: Your code here. */
 		page_insert(pgdir, asid, pa2page(pa + i), va + i, perm);
 	}
+
+	/* Step 2: Let the TLB map every suitably aligned range with a single superpage entry. */
+	for (u_long off = ROUND(va, HUGE_PAIR_SIZE) - va; off + HUGE_PAIR_SIZE <= size;
+	     off += HUGE_PAIR_SIZE) {
+		page_promote(pgdir, asid, va + off);
+	}
 }
 
 /* Overview:
@@ -148,11 +142,11 @@ int envid2env(u_int envid, struct Env **penv, int checkperm) {
  */
 void env_init(void) {
 	int i;
-	/* Step 1: Initialize 'env_free_list' with 'LIST_INIT' and 'env_sched_list' with
-	 * 'TAILQ_INIT'. */
+	/* Step 1: Initialize 'env_free_list' with 'LIST_INIT' and the run queues with
+	 * 'sched_init'. */
 	/* Exercise 3.1: Your code here. (1/2) */
 	LIST_INIT(&env_free_list);
-	TAILQ_INIT(&env_sched_list);
+	sched_init();
 	/* Step 2: Traverse the elements of 'envs' array, set their status to 'ENV_FREE' and insert
 	 * them into the 'env_free_list'. Make sure, after the insertion, the order of envs in the
 	 * list should be the same as they are in the 'envs' array. */
@@ -196,6 +190,7 @@ static int env_setup_vm(struct Env *e) {
 	try(page_alloc(&p));
 	/* Exercise 3.3: Your code here. */
 	(p->pp_ref)++;
+	page_set_pgtable(p);
 	e->env_pgdir = (Pde*)page2kva(p);
 	/* Step 2: Copy the template page directory 'base_pgdir' to 'e->env_pgdir'. */
 	/* Hint:
@@ -221,18 +216,19 @@ static int env_setup_vm(struct Env *e) {
  *
  * Post-Condition:
  *   return 0 on success, and basic fields of the new Env are set up.
- *   return < 0 on error, if no free env, no free asid, or 'env_setup_vm' failed.
+ *   return < 0 on error, if no free env, or 'env_setup_vm' failed.
+ *   The new env gets no ASID yet: 'env_run' hands one out when it first runs.
  *
  * Hints:
  *   You may need to use these functions or macros:
- *     'LIST_FIRST', 'LIST_REMOVE', 'mkenvid', 'asid_alloc', 'env_setup_vm'
+ *     'LIST_FIRST', 'LIST_REMOVE', 'mkenvid', 'env_setup_vm'
  *   Following fields of Env should be set up:
  *     'env_id', 'env_asid', 'env_parent_id', 'env_tf.regs[29]', 'env_tf.cp0_status',
  *     'env_user_tlb_mod_entry', 'env_runs'
  */
 int env_alloc(struct Env **new, u_int parent_id) {
 	int r;
-	struct Env *e;
+	struct Env *e, *parent;
 
 	/* Step 1: Get a free Env from 'env_free_list' */
 	/* Exercise 3.4: Your code here. (1/4) */
@@ -252,16 +248,35 @@ int env_alloc(struct Env **new, u_int parent_id) {
 	 *   'env_parent_id' (lab3)
 	 *
 	 * Hint:
-	 *   Use 'asid_alloc' to allocate a free asid.
 	 *   Use 'mkenvid' to allocate a free envid.
 	 */
 	e->env_user_tlb_mod_entry = 0; // for lab4
+	e->env_user_pgfault_entry = 0;
+	e->env_user_pgfault_lo = e->env_user_pgfault_hi = 0;
+	LIST_INIT(&e->env_lazy_segs);
+	e->env_template = 0;
+	e->env_disk = 0;
+	e->env_fs = 0;
+	e->env_sched_priv = 0;
 	e->env_runs = 0;	       // for lab6
+	e->env_runtime = 0;
+	e->env_sched_class = ENV_SCHED_PRIO;
+	e->env_inh_pri = 0;
+	e->env_slice = 0;
+	e->env_waiting = NULL;
+	LIST_INIT(&e->env_waiters);
 	/* Exercise 3.4: Your code here. (3/4) */
 	e->env_id = mkenvid(e);
+	e->env_asid = 0;
 	e->env_parent_id = parent_id;
-	if ((r = asid_alloc(&(e->env_asid))) != 0) {
-		return r;
+	e->env_exit_status = 0;
+	e->env_nchild = 0;
+	e->env_wait_recving = 0;
+	LIST_INIT(&e->env_exits);
+	if (parent_id != 0 && envid2env(parent_id, &parent, 0) == 0) {
+		parent->env_nchild++;
+		// a child is scheduled in the class of its parent, see 'sys_set_env_sched'
+		e->env_sched_class = parent->env_sched_class;
 	}
 
 	/* Step 4: Initialize the sp and 'cp0_status' in 'e->env_tf'.
@@ -281,44 +296,31 @@ int env_alloc(struct Env **new, u_int parent_id) {
 }
 
 /* Overview:
- *   Load a page into the user address space of an env with permission 'perm'.
- *   If 'src' is not NULL, copy the 'len' bytes from 'src' into 'offset' at this page.
- *
- * Pre-Condition:
- *   'offset + len' is not larger than 'PAGE_SIZE'.
+ *   Record the loadable segment 'ph', whose file data is at 'bin' in the kernel image, as a
+ *   lazy segment of 'e': nothing is allocated now, each page gets filled in by 'lazy_fault'
+ *   the first time it's touched.
  *
  * Hint:
- *   The address of env structure is passed through 'data' from 'elf_load_seg', where this function
- *   works as a callback.
- *
- * Note:
- *   This function involves loading executable code to memory. After the completion of load
- *   procedures, D-cache and I-cache writeback/invalidation MUST be performed to maintain cache
- *   coherence, which MOS has NOT implemented. This may result in unexpected behaviours on real
- *   CPUs! QEMU doesn't simulate caching, allowing the OS to function correctly.
+ *   The segment takes references on the kernel image pages holding 'bin'. Those are never
+ *   freed anyway, so it can read them for as long as it lives.
  */
-static int load_icode_mapper(void *data, u_long va, size_t offset, u_int perm, const void *src,
-			     size_t len) {
-	struct Env *env = (struct Env *)data;
-	struct Page *p;
-	int r;
+static int load_icode_seg(struct Env *e, const Elf32_Phdr *ph, const void *bin) {
+	struct Lazy_seg *ls;
+	u_int perm = PTE_V;
 
-	/* Step 1: Allocate a page with 'page_alloc'. */
-	/* Exercise 3.5: Your code here. (1/2) */
-	if ((r = page_alloc(&p)) != 0) {
-		return r;
+	if (ph->p_flags & PF_W) {
+		perm |= PTE_D;
 	}
-
-	/* Step 2: If 'src' is not NULL, copy the 'len' bytes started at 'src' into 'offset' at this
-	 * page. */
-	// Hint: You may want to use 'memcpy'.
-	if (src != NULL) {
-		/* Exercise 3.5: Your code here. (2/2) */
-		memcpy((void*)(page2kva(p) + offset), src, len);
+	ls = lazy_seg_alloc(ph->p_vaddr, ph->p_memsz, ph->p_filesz, perm, (u_long)bin % PAGE_SIZE);
+	if (ls == NULL) {
+		return -E_NO_MEM;
 	}
-
-	/* Step 3: Insert 'p' into 'env->env_pgdir' at 'va' with 'perm'. */
-	return page_insert(env->env_pgdir, env->env_asid, p, va, perm);
+	for (u_int i = 0; i < ls->ls_npage; i++) {
+		ls->ls_pages[i] = pa2page(PADDR(ROUNDDOWN(bin, PAGE_SIZE)) + i * PAGE_SIZE);
+		ls->ls_pages[i]->pp_ref++;
+	}
+	lazy_seg_insert(e, ls);
+	return 0;
 }
 
 /* Overview:
@@ -333,17 +335,14 @@ static void load_icode(struct Env *e, const void *binary, size_t size) {
 		panic("bad elf at %x", binary);
 	}
 
-	/* Step 2: Load the segments using 'ELF_FOREACH_PHDR_OFF' and 'elf_load_seg'.
+	/* Step 2: Record the segments using 'ELF_FOREACH_PHDR_OFF' and 'load_icode_seg'.
 	 * As a loader, we just care about loadable segments, so parse only program headers here.
 	 */
 	size_t ph_off;
 	ELF_FOREACH_PHDR_OFF (ph_off, ehdr) {
 		Elf32_Phdr *ph = (Elf32_Phdr *)(binary + ph_off);
 		if (ph->p_type == PT_LOAD) {
-			// 'elf_load_seg' is defined in lib/elfloader.c
-			// 'load_icode_mapper' defines the way in which a page in this segment
-			// should be mapped.
-			panic_on(elf_load_seg(ph, binary + ph->p_offset, load_icode_mapper, e));
+			panic_on(load_icode_seg(e, ph, binary + ph->p_offset));
 		}
 	}
 
@@ -372,23 +371,152 @@ struct Env *env_create(const void *binary, size_t size, int priority) {
 	e->env_status = ENV_RUNNABLE;
 
 	/* Step 3: Use 'load_icode' to load the image from 'binary', and insert 'e' into
-	 * 'env_sched_list' using 'TAILQ_INSERT_HEAD'. */
+	 * the run queues using 'sched_insert'. */
 	/* Exercise 3.7: Your code here. (3/3) */
 	load_icode(e, binary, size);
-	TAILQ_INSERT_HEAD(&env_sched_list, e, env_sched_link);
+	sched_insert(e);
 	return e;
 }
 
+/* Overview:
+ *   Mark 'e', just created by 'env_create', as the file system server, see 'ENV_CREATE_FS'.
+ *   It may raise priorities and classes, see 'sys_set_env_pri', and revoke its pages from
+ *   other envs, see 'sys_mem_revoke'. It drives the IDE disk, so it's never swapped out, not
+ *   even before it first gets to the disk (see 'sys_read_dev').
+ */
+void env_init_fs(struct Env *e) {
+	e->env_fs = 1;
+	e->env_sched_priv = 1;
+	e->env_disk = 1;
+}
+
+/* Overview:
+ *   Give 'child' a copy-on-write copy of the address space of 'parent' below 'USTACKTOP'.
+ *   Both envs share every mapped page afterwards: pages that are writable ('PTE_D') and not
+ *   'PTE_LIBRARY' become 'PTE_COW' and read-only in both, the others keep their permission.
+ *   The lazy segments of 'parent' are copied as well.
+ *
+ * Pre-Condition:
+ *   'child' has no mappings below 'USTACKTOP'.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_NO_MEM if a page table, reverse mapping or lazy segment can't
+ *   be allocated for 'child'. In that case, what was copied so far stays in 'child' (and COW in 'parent').
+ *
+ * Hint:
+ *   The page tables are walked directly, one page table page at a time. The write permission
+ *   taken away from 'parent' is flushed with a single sweep over its ASID at the end.
+ */
+int env_dup_vm(struct Env *child, struct Env *parent) {
+	struct Page *pt_page;
+	Pte *spt, *dpt;
+	u_int pdeno, pteno;
+	int r = 0;
+
+	for (pdeno = 0; pdeno < PDX(USTACKTOP - 1) + 1; pdeno++) {
+		if (!(parent->env_pgdir[pdeno] & PTE_V)) {
+			continue;
+		}
+		if ((r = page_alloc(&pt_page)) != 0) {
+			break;
+		}
+		pt_page->pp_ref++;
+		page_set_pgtable(pt_page);
+		child->env_pgdir[pdeno] = page2pa(pt_page) | PTE_C_CACHEABLE | PTE_V;
+		spt = (Pte *)KADDR(PTE_ADDR(parent->env_pgdir[pdeno]));
+		dpt = (Pte *)page2kva(pt_page);
+		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+			if (((pdeno << PDSHIFT) | (pteno << PGSHIFT)) >= USTACKTOP) {
+				break;
+			}
+			if (!(spt[pteno] & PTE_V) && !PTE_IS_SWAP(spt[pteno])) {
+				continue;
+			}
+			if ((spt[pteno] & PTE_V) &&
+			    (r = page_rmap_add(pa2page(spt[pteno]), child->env_pgdir,
+					       (pdeno << PDSHIFT) | (pteno << PGSHIFT))) != 0) {
+				break;
+			}
+			if ((spt[pteno] & PTE_D) && !(spt[pteno] & PTE_LIBRARY)) {
+				// every page of a superpage gets the same bits, so it stays one
+				pte_set(&spt[pteno], (spt[pteno] & ~PTE_D) | PTE_COW);
+			}
+			pte_set(&dpt[pteno], spt[pteno]);
+			if (spt[pteno] & PTE_V) {
+				pa2page(spt[pteno])->pp_ref++;
+			} else {
+				// both come back from the same swap slot, each with a copy of its own
+				swap_dup(spt[pteno]);
+			}
+		}
+		if (r != 0) {
+			break;
+		}
+	}
+	tlb_invalidate_asid(parent->env_asid);
+	if (r == 0) {
+		r = lazy_seg_dup(child, parent);
+	}
+	return r;
+}
+
+/* Overview:
+ *   Tell the parent of 'e', if it's still there, that 'e' exits: wake it up with the exit
+ *   status of 'e' if it's blocked in 'sys_wait' for it, or else keep the status for it.
+ *   A template isn't waited for, so its parent isn't told, see 'sys_env_template'.
+ *   Then drop the statuses 'e' kept for its own children.
+ *
+ * Hint:
+ *   If there's no memory to keep the status in, the parent can't get it. 'sys_wait' then
+ *   waits for another child, or fails if there's none.
+ */
+static void env_exit_notify(struct Env *e) {
+	struct Env *parent;
+	struct Env_exit *ee;
+
+	if (e->env_parent_id != 0 && !e->env_template &&
+	    envid2env(e->env_parent_id, &parent, 0) == 0) {
+		parent->env_nchild--;
+		if (parent->env_wait_recving &&
+		    (parent->env_wait_id == 0 || parent->env_wait_id == e->env_id)) {
+			parent->env_wait_recving = 0;
+			parent->env_wait_status = e->env_exit_status;
+			parent->env_tf.regs[2] = e->env_id;
+			parent->env_status = ENV_RUNNABLE;
+			sched_insert(parent);
+		} else if ((ee = kmalloc(sizeof(*ee))) != NULL) {
+			ee->ee_id = e->env_id;
+			ee->ee_status = e->env_exit_status;
+			LIST_INSERT_HEAD(&parent->env_exits, ee, ee_link);
+		}
+	}
+	while ((ee = LIST_FIRST(&e->env_exits)) != NULL) {
+		LIST_REMOVE(ee, ee_link);
+		kfree(ee);
+	}
+	e->env_nchild = 0;
+	e->env_wait_recving = 0;
+}
+
 /* Overview:
  *  Free env e and all memory it uses.
  */
 void env_free(struct Env *e) {
+	struct Page *pp;
 	Pte *pt;
 	u_int pdeno, pteno, pa;
 
 	/* Hint: Note the environment's demise.*/
 	printk("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	/* Hint: the templates 'e' made go with it (a template has no children of its own). */
+	for (int i = 0; i < NENV; i++) {
+		if (envs[i].env_status != ENV_FREE && envs[i].env_template &&
+		    envs[i].env_parent_id == e->env_id) {
+			env_free(&envs[i]);
+		}
+	}
+
 	/* Hint: Flush all mapped pages in the user portion of the address space */
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 		/* Hint: only look at mapped page tables. */
@@ -398,29 +526,37 @@ void env_free(struct Env *e) {
 		/* Hint: find the pa and va of the page table. */
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (Pte *)KADDR(pa);
-		/* Hint: Unmap all PTEs in this page table. */
+		/* Hint: Drop the reference held by every PTE in this page table. The page table goes
+		 * away with them, and the TLB is flushed for the whole ASID below, so there is no need
+		 * to invalidate them one by one with 'page_remove'. They're still cleared with
+		 * 'pte_set', for the counts of the other page tables mapping the same pages. */
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_V) {
-				page_remove(e->env_pgdir, e->env_asid,
-					    (pdeno << PDSHIFT) | (pteno << PGSHIFT));
+				pp = pa2page(pt[pteno]);
+				page_rmap_remove(pp, e->env_pgdir,
+						 (pdeno << PDSHIFT) | (pteno << PGSHIFT));
+				pte_set(&pt[pteno], 0);
+				page_decref(pp);
+			} else if (PTE_IS_SWAP(pt[pteno])) {
+				swap_free(pt[pteno]);
 			}
 		}
 		/* Hint: free the page table itself. */
 		e->env_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
-		/* Hint: invalidate page table in TLB */
-		tlb_invalidate(e->env_asid, UVPT + (pdeno << PGSHIFT));
 	}
 	/* Hint: free the page directory. */
 	page_decref(pa2page(PADDR(e->env_pgdir)));
-	/* Hint: free the ASID */
-	asid_free(e->env_asid);
-	/* Hint: invalidate page directory in TLB */
-	tlb_invalidate(e->env_asid, UVPT + (PDX(UVPT) << PGSHIFT));
+	/* Hint: free the segments that were never loaded completely. */
+	lazy_seg_free_all(e);
+	/* Hint: invalidate all the TLB entries of the env, page table windows at UVPT included */
+	tlb_invalidate_asid(e->env_asid);
 	/* Hint: return the environment to the free list. */
 	e->env_status = ENV_FREE;
 	LIST_INSERT_HEAD((&env_free_list), (e), env_link);
-	TAILQ_REMOVE(&env_sched_list, (e), env_sched_link);
+	sched_remove(e);
+	sched_wait_drop(e);
+	env_exit_notify(e);
 }
 
 /* Overview:
@@ -479,7 +615,8 @@ void env_run(struct Env *e) {
 	/* Step 3: Change 'cur_pgdir' to 'curenv->env_pgdir', switching to its address space. */
 	/* Exercise 3.8: Your code here. (1/2) */
 	cur_pgdir = curenv->env_pgdir;
-	
+	asid_alloc(curenv);
+
 	/* Step 4: Use 'env_pop_tf' to restore the curenv's saved context (registers) and return/go
 	 * to user mode.
 	 *
@@ -489,7 +626,7 @@ void env_run(struct Env *e) {
 	 *    returning to the kernel caller, making 'env_run' a 'noreturn' function as well.
 	 */
 	/* Exercise 3.8: Your code here. (2/2) */
-	env_pop_tf(&curenv->env_tf, curenv->env_asid);
+	env_pop_tf(&curenv->env_tf, curenv->env_asid & (NASID - 1));
 }
 
 void env_check() {
@@ -546,9 +683,9 @@ void env_check() {
 	printk("pe2`s sp register %x\n", pe2->env_tf.regs[29]);
 
 	/* free all env allocated in this function */
-	TAILQ_INSERT_TAIL(&env_sched_list, pe0, env_sched_link);
-	TAILQ_INSERT_TAIL(&env_sched_list, pe1, env_sched_link);
-	TAILQ_INSERT_TAIL(&env_sched_list, pe2, env_sched_link);
+	sched_insert(pe0);
+	sched_insert(pe1);
+	sched_insert(pe2);
 
 	env_free(pe2);
 	env_free(pe1);
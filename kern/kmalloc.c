@@ -0,0 +1,282 @@
+#include <kmalloc.h>
+#include <pmap.h>
+#include <printk.h>
+
+#define SLAB_HDR_SIZE ROUND(sizeof(struct Slab), 16)
+
+static struct Kmem_cache kmem_caches[] = {
+    {"kmalloc-16", 16, 0},     {"kmalloc-32", 32, 0},	  {"kmalloc-64", 64, 0},
+    {"kmalloc-128", 128, 0},   {"kmalloc-256", 256, 0},	  {"kmalloc-512", 512, 0},
+    {"kmalloc-1024", 1024, 1}, {"kmalloc-2048", 2048, 2},
+};
+
+#define NKMEM_CACHE (sizeof(kmem_caches) / sizeof(kmem_caches[0]))
+
+// Large requests (above KMALLOC_MAX_SLAB) handed out as whole buddy blocks.
+static u_long kmalloc_large_nblock;
+static u_long kmalloc_large_npage;
+
+/* Overview:
+ *   Return the smallest cache whose objects can hold 'size' bytes, or NULL if there's none.
+ */
+static struct Kmem_cache *kmem_cache_of(size_t size) {
+	for (int i = 0; i < NKMEM_CACHE; i++) {
+		if (size <= kmem_caches[i].kc_size) {
+			return &kmem_caches[i];
+		}
+	}
+	return NULL;
+}
+
+/* Overview:
+ *   Get a new slab for 'kc' from the buddy allocator and thread all its objects onto its free
+ *   list.
+ *
+ * Post-Condition:
+ *   Return the slab, or NULL if there's no free block large enough.
+ */
+static struct Slab *slab_create(struct Kmem_cache *kc) {
+	struct Page *pp;
+	struct Slab *sl;
+	u_long base, obj, end;
+
+	if (page_alloc_pages(&pp, kc->kc_order) != 0) {
+		return NULL;
+	}
+	for (int i = 0; i < (1 << kc->kc_order); i++) {
+		pp[i].pp_ref = 1;
+		pp[i].pp_order = kc->kc_order;
+		pp[i].pp_flags |= PP_SLAB;
+	}
+
+	base = page2kva(pp);
+	end = base + (PAGE_SIZE << kc->kc_order);
+	sl = (struct Slab *)base;
+	sl->sl_cache = kc;
+	sl->sl_inuse = 0;
+	sl->sl_free = NULL;
+	// thread the objects from the last one, so that they are handed out in address order
+	for (obj = base + SLAB_HDR_SIZE + ((end - base - SLAB_HDR_SIZE) / kc->kc_size - 1) *
+					     kc->kc_size;
+	     obj >= base + SLAB_HDR_SIZE; obj -= kc->kc_size) {
+		*(void **)obj = sl->sl_free;
+		sl->sl_free = (void *)obj;
+	}
+	kc->kc_nslab++;
+	return sl;
+}
+
+/* Overview:
+ *   Give the pages of the empty slab 'sl' back to the buddy allocator.
+ */
+static void slab_destroy(struct Slab *sl) {
+	struct Kmem_cache *kc = sl->sl_cache;
+	struct Page *pp = pa2page(PADDR(sl));
+
+	for (int i = 0; i < (1 << kc->kc_order); i++) {
+		pp[i].pp_ref = 0;
+		pp[i].pp_flags &= ~PP_SLAB;
+	}
+	page_free_pages(pp, kc->kc_order);
+	kc->kc_nslab--;
+}
+
+/* Overview:
+ *   Allocate 'size' bytes of kernel memory. Requests up to 'KMALLOC_MAX_SLAB' bytes are served
+ *   from the slab cache of the smallest fitting size class, in O(1). Larger ones get a buddy
+ *   block of their own.
+ *
+ * Post-Condition:
+ *   Return the address of the object, aligned to 16 bytes (to PAGE_SIZE for large requests),
+ *   or NULL if 'size' is 0 or we're out of memory. The memory is NOT cleared.
+ */
+void *kmalloc(size_t size) {
+	struct Kmem_cache *kc;
+	struct Slab *sl;
+	struct Page *pp;
+	void *obj;
+
+	if (size == 0) {
+		return NULL;
+	}
+
+	if ((kc = kmem_cache_of(size)) == NULL) {
+		u_int order = 0;
+		while ((PAGE_SIZE << order) < size) {
+			if (++order > PAGE_MAX_ORDER) {
+				return NULL;
+			}
+		}
+		if (page_alloc_pages(&pp, order) != 0) {
+			return NULL;
+		}
+		pp->pp_ref = 1;
+		pp->pp_order = order;
+		pp->pp_flags |= PP_KLARGE;
+		kmalloc_large_nblock++;
+		kmalloc_large_npage += 1UL << order;
+		return (void *)page2kva(pp);
+	}
+
+	/* Step 1: Pick a slab with a free object, preferring partially used ones. */
+	if ((sl = LIST_FIRST(&kc->kc_partial)) == NULL) {
+		if ((sl = LIST_FIRST(&kc->kc_empty)) != NULL) {
+			LIST_REMOVE(sl, sl_link);
+			kc->kc_nempty--;
+		} else if ((sl = slab_create(kc)) == NULL) {
+			return NULL;
+		}
+		LIST_INSERT_HEAD(&kc->kc_partial, sl, sl_link);
+	}
+
+	/* Step 2: Take its first free object. */
+	obj = sl->sl_free;
+	sl->sl_free = *(void **)obj;
+	sl->sl_inuse++;
+	if (sl->sl_free == NULL) {
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&kc->kc_full, sl, sl_link);
+	}
+
+	kc->kc_inuse++;
+	kc->kc_nalloc++;
+	return obj;
+}
+
+/* Overview:
+ *   Free the memory at 'ptr' returned by 'kmalloc'. Does nothing if 'ptr' is NULL.
+ */
+void kfree(void *ptr) {
+	struct Page *pp;
+	struct Kmem_cache *kc;
+	struct Slab *sl;
+
+	if (ptr == NULL) {
+		return;
+	}
+	pp = pa2page(PADDR(ptr));
+
+	if (pp->pp_flags & PP_KLARGE) {
+		assert((u_long)ptr == page2kva(pp));
+		kmalloc_large_nblock--;
+		kmalloc_large_npage -= 1UL << pp->pp_order;
+		pp->pp_ref = 0;
+		pp->pp_flags &= ~PP_KLARGE;
+		page_free_pages(pp, pp->pp_order);
+		return;
+	}
+	if (!(pp->pp_flags & PP_SLAB)) {
+		panic("kfree: %x was not returned by kmalloc", ptr);
+	}
+
+	sl = (struct Slab *)ROUNDDOWN((u_long)ptr, PAGE_SIZE << pp->pp_order);
+	kc = sl->sl_cache;
+	assert(((u_long)ptr - (u_long)sl - SLAB_HDR_SIZE) % kc->kc_size == 0);
+
+	if (sl->sl_free == NULL) {
+		// it was full, now it has a free object
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&kc->kc_partial, sl, sl_link);
+	}
+	*(void **)ptr = sl->sl_free;
+	sl->sl_free = ptr;
+	sl->sl_inuse--;
+	kc->kc_inuse--;
+	kc->kc_nfree++;
+
+	if (sl->sl_inuse == 0) {
+		// keep a few empty slabs around to avoid bouncing pages with the buddy allocator
+		LIST_REMOVE(sl, sl_link);
+		if (kc->kc_nempty < KMEM_EMPTY_MAX) {
+			LIST_INSERT_HEAD(&kc->kc_empty, sl, sl_link);
+			kc->kc_nempty++;
+		} else {
+			slab_destroy(sl);
+		}
+	}
+}
+
+/* Overview:
+ *   Return the number of pages taken from the buddy allocator by slabs and large requests.
+ */
+u_long kmalloc_npage(void) {
+	u_long n = kmalloc_large_npage;
+
+	for (int i = 0; i < NKMEM_CACHE; i++) {
+		n += (u_long)kmem_caches[i].kc_nslab << kmem_caches[i].kc_order;
+	}
+	return n;
+}
+
+/* Overview:
+ *   Print the statistics of every size class and of large allocations.
+ */
+void kmalloc_info(void) {
+	printk("cache          size  slabs  inuse      allocs       frees\n");
+	for (int i = 0; i < NKMEM_CACHE; i++) {
+		struct Kmem_cache *kc = &kmem_caches[i];
+		printk("%-13s %5u %6u %6u %11lu %11lu\n", kc->kc_name, kc->kc_size, kc->kc_nslab,
+		       kc->kc_inuse, kc->kc_nalloc, kc->kc_nfree);
+	}
+	printk("large blocks: %lu (%lu pages)\n", kmalloc_large_nblock, kmalloc_large_npage);
+}
+
+void kmalloc_check(void) {
+	static void *objs[512];
+	u_int sizes[] = {1, 16, 17, 40, 100, 128, 250, 600, 1000, 2048};
+	u_int inuse[NKMEM_CACHE];
+
+	for (int i = 0; i < NKMEM_CACHE; i++) {
+		inuse[i] = kmem_caches[i].kc_inuse;
+	}
+
+	assert(kmalloc(0) == NULL);
+
+	// objects are aligned, large enough, and don't overlap
+	for (int i = 0; i < 512; i++) {
+		u_int size = sizes[i % 10];
+		objs[i] = kmalloc(size);
+		assert(objs[i] != NULL);
+		assert(((u_long)objs[i] & 15) == 0);
+		assert(pa2page(PADDR(objs[i]))->pp_flags & PP_SLAB);
+		memset(objs[i], i & 0xff, size);
+	}
+	for (int i = 0; i < 512; i++) {
+		u_char *p = objs[i];
+		for (int j = 0; j < sizes[i % 10]; j++) {
+			assert(p[j] == (i & 0xff));
+		}
+	}
+
+	// a freed object is handed out again right away
+	void *p = objs[0];
+	kfree(p);
+	objs[0] = kmalloc(sizes[0]);
+	assert(objs[0] == p);
+
+	for (int i = 0; i < 512; i++) {
+		kfree(objs[(i * 7) % 512]);
+	}
+	for (int i = 0; i < NKMEM_CACHE; i++) {
+		assert(kmem_caches[i].kc_inuse == inuse[i]);
+		assert(kmem_caches[i].kc_nempty <= KMEM_EMPTY_MAX);
+	}
+
+	// large requests get page-aligned buddy blocks
+	void *big = kmalloc(3 * PAGE_SIZE);
+	assert(big != NULL && ((u_long)big & (PAGE_SIZE - 1)) == 0);
+	assert(pa2page(PADDR(big))->pp_flags & PP_KLARGE);
+	assert(kmalloc_large_npage >= 4);
+	memset(big, 0xab, 3 * PAGE_SIZE);
+	kfree(big);
+	assert(kmalloc((PAGE_SIZE << PAGE_MAX_ORDER) + 1) == NULL);
+
+	// slabs left with no object in use are either cached or back in the buddy allocator
+	for (int i = 0; i < NKMEM_CACHE; i++) {
+		struct Kmem_cache *kc = &kmem_caches[i];
+		assert(kc->kc_inuse != 0 || kc->kc_nslab == kc->kc_nempty);
+	}
+
+	kmalloc_info();
+	printk("kmalloc_check() succeeded!\n");
+}
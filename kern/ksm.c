@@ -0,0 +1,215 @@
+#include <env.h>
+#include <ksm.h>
+#include <pmap.h>
+#include <printk.h>
+
+extern struct Env envs[];
+
+// Software bits of a PTE. Only anonymous pages are merged: 'PTE_LIBRARY' pages are shared on
+// purpose, superpages are mapped as a whole, and other bits belong to user space (e.g. the file
+// system server's dirty bit).
+#define PTE_SOFT_FLAGS ((1 << PTE_HARDFLAG_SHIFT) - 1)
+
+// A page seen by the scanner, with the hash of its contents back then.
+struct Ksm_slot {
+	struct Page *ks_page;
+	u_int ks_hash;
+};
+
+static struct Ksm_slot ksm_table[KSM_NBUCKET];
+
+// Merged pages, linked through 'pp_link' (unused while a page is allocated).
+static struct Page_list ksm_pages;
+
+u_int ksm_batch; // pages to scan each time the system is idle, 0 if merging is off
+
+// The scanner's hand: the page at 'ksm_hand_va' in 'envs[ksm_hand_env]'.
+static u_int ksm_hand_env;
+static u_long ksm_hand_va = UTEMP;
+
+static u_long ksm_nzero;
+static u_long ksm_nscan;
+
+/* Overview:
+ *   Return the FNV-1a hash of the words of 'pp', and set '*zero' to whether they're all 0.
+ */
+static u_int ksm_hash(struct Page *pp, int *zero) {
+	const u_int *p = kmap(pp);
+	u_int h = 2166136261u, any = 0;
+
+	for (int i = 0; i < PAGE_SIZE / sizeof(u_int); i++) {
+		h = (h ^ p[i]) * 16777619u;
+		any |= p[i];
+	}
+	kunmap((void *)p);
+	*zero = any == 0;
+	return h;
+}
+
+/* Overview:
+ *   Tell whether the pages 'a' and 'b' hold the same bytes.
+ */
+static int ksm_same(struct Page *a, struct Page *b) {
+	const u_int *p = kmap(a);
+	const u_int *q = kmap(b);
+	int same = 1;
+
+	for (int i = 0; i < PAGE_SIZE / sizeof(u_int) && same; i++) {
+		same = p[i] == q[i];
+	}
+	kunmap((void *)q);
+	kunmap((void *)p);
+	return same;
+}
+
+/* Overview:
+ *   Tell whether the page mapped by 'pte' is an anonymous page mapped there only, which may be
+ *   merged with others: it carries no software bit other than 'PTE_COW', and its only
+ *   reference is this mapping.
+ */
+static int ksm_candidate(Pte pte) {
+	struct Page *pp;
+
+	if (!(pte & PTE_V) || (pte & PTE_SOFT_FLAGS & ~PTE_COW)) {
+		return 0;
+	}
+	pp = pa2page(pte);
+	return pp != zero_page && !(pp->pp_flags & PP_KSM) && pp->pp_ref == 1 &&
+	       !LIST_EMPTY(&pp->pp_rmap);
+}
+
+/* Overview:
+ *   Tell whether the page 'pp' found in the table can still take the mappings of the pages
+ *   equal to it: it's either merged already, or still a candidate mapped by the PTE its only
+ *   reverse mapping points to, which is then returned in '*ppte'. Any other page may have been
+ *   freed and reused by the kernel since it was seen.
+ */
+static int ksm_mergeable(struct Page *pp, Pte **ppte) {
+	struct Rmap *rm;
+
+	*ppte = NULL;
+	if (pp->pp_flags & PP_KSM) {
+		return 1;
+	}
+	if (pp->pp_ref != 1 || (rm = LIST_FIRST(&pp->pp_rmap)) == NULL) {
+		return 0;
+	}
+	return page_lookup(rm->rm_pgdir, rm->rm_va, ppte) == pp && ksm_candidate(**ppte);
+}
+
+/* Overview:
+ *   Share the page 'dup' mapped at 'va' of 'e' by 'pte' with 'pp' (or the zero page) if they're
+ *   equal, or remember 'dup' so that later pages can be merged with it.
+ *
+ * Hint:
+ *   A merged page is only ever mapped copy-on-write, see 'page_insert': the first write
+ *   through a mapping gets a copy of its own from 'cow_resolve'. The only mapping of a page
+ *   about to become merged is write protected here, and the TLB swept for it.
+ */
+static void ksm_scan_page(struct Env *e, u_long va, Pte *pte) {
+	struct Page *dup = pa2page(*pte);
+	struct Page *pp;
+	struct Ksm_slot *ks;
+	Pte *ppte;
+	u_int h;
+	int zero;
+
+	h = ksm_hash(dup, &zero);
+	if (zero) {
+		if (page_insert(e->env_pgdir, e->env_asid, zero_page_get(), va, PTE_FLAGS(*pte)) ==
+		    0) {
+			ksm_nzero++;
+		}
+		return;
+	}
+
+	ks = &ksm_table[h % KSM_NBUCKET];
+	pp = ks->ks_page;
+	if (pp == NULL || pp == dup || ks->ks_hash != h || !ksm_mergeable(pp, &ppte) ||
+	    !ksm_same(pp, dup)) {
+		ks->ks_page = dup;
+		ks->ks_hash = h;
+		return;
+	}
+	if (!(pp->pp_flags & PP_KSM)) {
+		if (*ppte & PTE_D) {
+			pte_set(ppte, (*ppte & ~PTE_D) | PTE_COW);
+		}
+		tlb_flush_pa(page2pa(pp));
+		pp->pp_flags |= PP_KSM;
+		LIST_INSERT_HEAD(&ksm_pages, pp, pp_link);
+	}
+	// 'dup' goes away with its only mapping
+	page_insert(e->env_pgdir, e->env_asid, pp, va, PTE_FLAGS(*pte));
+}
+
+/* Overview:
+ *   Move the scanner's hand over 'n' pages of the user address spaces of all envs, merging the
+ *   anonymous pages found equal into one copy-on-write page.
+ *
+ * Hint:
+ *   Pages are compared with those seen before by hash. As pages may be written to after they
+ *   were hashed, a match is compared byte for byte before the pages are merged.
+ */
+void ksm_scan(u_int n) {
+	struct Env *e;
+	Pte *pte;
+	u_long va;
+
+	for (u_int nenv = 0; n > 0 && nenv < NENV;) {
+		e = &envs[ksm_hand_env];
+		if (e->env_status == ENV_FREE || ksm_hand_va >= UTOP) {
+			ksm_hand_env = (ksm_hand_env + 1) % NENV;
+			ksm_hand_va = UTEMP;
+			nenv++;
+			continue;
+		}
+		va = ksm_hand_va;
+		if (!(e->env_pgdir[PDX(va)] & PTE_V)) {
+			ksm_hand_va = ROUNDDOWN(va, PDMAP) + PDMAP;
+			continue;
+		}
+		ksm_hand_va += PAGE_SIZE;
+		n--;
+		ksm_nscan++;
+		if (page_lookup(e->env_pgdir, va, &pte) != NULL && ksm_candidate(*pte)) {
+			ksm_scan_page(e, va, pte);
+		}
+	}
+}
+
+/* Overview:
+ *   Let the scanner go over 'ksm_batch' pages, as the CPU would otherwise sit idle.
+ */
+void ksm_idle(void) {
+	ksm_scan(ksm_batch);
+}
+
+/* Overview:
+ *   Stop treating 'pp' as a merged page, as it's about to be freed, or written to through its
+ *   last mapping. Does nothing if 'pp' isn't merged.
+ */
+void ksm_unmerge(struct Page *pp) {
+	if (pp->pp_flags & PP_KSM) {
+		LIST_REMOVE(pp, pp_link);
+		pp->pp_flags &= ~PP_KSM;
+	}
+}
+
+/* Overview:
+ *   Fill in 'info' with the state of the scanner. The pages saved by merging are
+ *   'ki_sharing - ki_shared', plus those replaced by the zero page.
+ */
+void ksm_info(struct Ksm_info *info) {
+	struct Page *pp;
+
+	info->ki_batch = ksm_batch;
+	info->ki_shared = 0;
+	info->ki_sharing = 0;
+	LIST_FOREACH (pp, &ksm_pages, pp_link) {
+		info->ki_shared++;
+		info->ki_sharing += pp->pp_ref;
+	}
+	info->ki_nzero = ksm_nzero;
+	info->ki_nscan = ksm_nscan;
+}
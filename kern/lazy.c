@@ -0,0 +1,172 @@
+#include <env.h>
+#include <kmalloc.h>
+#include <lazy.h>
+#include <pmap.h>
+
+/* Overview:
+ *   Allocate a lazy segment of 'memsz' bytes at 'va' mapped with 'perm', whose first 'filesz'
+ *   bytes come from the file data starting at offset 'off' of the first source page.
+ *
+ * Post-Condition:
+ *   Return the segment, or NULL if we're out of memory. The caller fills in all 'ls_npage'
+ *   entries of 'ls_pages', taking a reference on each of them, before inserting it.
+ */
+struct Lazy_seg *lazy_seg_alloc(u_long va, u_long memsz, u_long filesz, u_int perm, u_int off) {
+	struct Lazy_seg *ls;
+
+	if ((ls = kmalloc(sizeof(struct Lazy_seg))) == NULL) {
+		return NULL;
+	}
+	ls->ls_va = va;
+	ls->ls_memsz = memsz;
+	ls->ls_filesz = filesz;
+	ls->ls_perm = perm;
+	ls->ls_off = off;
+	ls->ls_npage = filesz ? ROUND(off + filesz, PAGE_SIZE) / PAGE_SIZE : 0;
+	ls->ls_pages = NULL;
+	if (ls->ls_npage != 0) {
+		if ((ls->ls_pages = kmalloc(ls->ls_npage * sizeof(struct Page *))) == NULL) {
+			kfree(ls);
+			return NULL;
+		}
+		memset(ls->ls_pages, 0, ls->ls_npage * sizeof(struct Page *));
+	}
+	return ls;
+}
+
+/* Overview:
+ *   Drop the source pages of 'ls' (those filled in so far) and free it.
+ */
+void lazy_seg_free(struct Lazy_seg *ls) {
+	for (u_int i = 0; i < ls->ls_npage; i++) {
+		if (ls->ls_pages[i] != NULL) {
+			page_decref(ls->ls_pages[i]);
+		}
+	}
+	kfree(ls->ls_pages);
+	kfree(ls);
+}
+
+/* Overview:
+ *   Add the lazy segment 'ls' to the address space of 'e'.
+ */
+void lazy_seg_insert(struct Env *e, struct Lazy_seg *ls) {
+	LIST_INSERT_HEAD(&e->env_lazy_segs, ls, ls_link);
+}
+
+/* Overview:
+ *   Free all the lazy segments of 'e'.
+ */
+void lazy_seg_free_all(struct Env *e) {
+	struct Lazy_seg *ls;
+
+	while ((ls = LIST_FIRST(&e->env_lazy_segs)) != NULL) {
+		LIST_REMOVE(ls, ls_link);
+		lazy_seg_free(ls);
+	}
+}
+
+/* Overview:
+ *   Give 'child' the lazy segments of 'parent', so that the pages neither of them touched yet
+ *   are filled in the same way in both.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_NO_MEM (the segments copied so far stay in 'child').
+ */
+int lazy_seg_dup(struct Env *child, struct Env *parent) {
+	struct Lazy_seg *ls, *nls;
+
+	LIST_FOREACH (ls, &parent->env_lazy_segs, ls_link) {
+		nls = lazy_seg_alloc(ls->ls_va, ls->ls_memsz, ls->ls_filesz, ls->ls_perm, ls->ls_off);
+		if (nls == NULL) {
+			return -E_NO_MEM;
+		}
+		for (u_int i = 0; i < ls->ls_npage; i++) {
+			nls->ls_pages[i] = ls->ls_pages[i];
+			nls->ls_pages[i]->pp_ref++;
+		}
+		lazy_seg_insert(child, nls);
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Copy 'len' bytes at offset 'off' of the file data of 'ls' to 'dst'.
+ */
+static void lazy_seg_read(struct Lazy_seg *ls, void *dst, u_long off, u_long len) {
+	off += ls->ls_off;
+	while (len > 0) {
+		u_long n = MIN(len, PAGE_SIZE - off % PAGE_SIZE);
+		void *src = kmap(ls->ls_pages[off / PAGE_SIZE]);
+		memcpy(dst, src + off % PAGE_SIZE, n);
+		kunmap(src);
+		dst += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* Overview:
+ *   Map the page at 'va' in 'e' if it's part of one of its lazy segments.
+ *   A page with some file data gets a fresh copy of it, unless the segment is read-only, the
+ *   page is all file data, and that data fills a whole source page: then the source page
+ *   itself is mapped, so that all the envs sharing the segment (forked or cloned from one
+ *   another) share a single copy of its text. The source pages are the copy 'sys_lazy_seg'
+ *   took of the file data, never written to. A page of zeros only (the '.bss') gets the shared zero page, copy-on-write if the
+ *   segment is writable.
+ *
+ * Post-Condition:
+ *   Return 0 if the page is mapped.
+ *   Return -E_INVAL if 'va' isn't in a lazy segment of 'e'.
+ *   Return -E_NO_MEM if we're out of memory.
+ */
+int lazy_fault(struct Env *e, u_long va) {
+	struct Lazy_seg *ls;
+	struct Page *pp;
+	u_long begin, end;
+	int r;
+
+	va = ROUNDDOWN(va, PAGE_SIZE);
+	LIST_FOREACH (ls, &e->env_lazy_segs, ls_link) {
+		if (va + PAGE_SIZE > ls->ls_va && va < ls->ls_va + ls->ls_memsz) {
+			break;
+		}
+	}
+	if (ls == NULL) {
+		return -E_INVAL;
+	}
+
+	// the file data in this page is at [begin, end)
+	begin = MAX(va, ls->ls_va);
+	end = MIN(va + PAGE_SIZE, ls->ls_va + ls->ls_filesz);
+#if !defined(LAB) || LAB >= 4
+	// the zero page needs 'cow_resolve' to be written to
+	if (begin >= end) {
+		u_int perm = ls->ls_perm;
+		if (perm & PTE_D) {
+			perm = (perm & ~PTE_D) | PTE_COW;
+		}
+		return page_insert(e->env_pgdir, e->env_asid, zero_page_get(), va, perm);
+	}
+#endif
+
+	if (begin == va && end == va + PAGE_SIZE) {
+		// a read-only page lined up with its source page is mapped as is, no copy
+		if (!(ls->ls_perm & PTE_D) && ls->ls_off == ls->ls_va % PAGE_SIZE) {
+			pp = ls->ls_pages[(va - ROUNDDOWN(ls->ls_va, PAGE_SIZE)) / PAGE_SIZE];
+			return page_insert(e->env_pgdir, e->env_asid, pp, va, ls->ls_perm);
+		}
+		try(page_alloc_user_nozero(&pp));
+	} else {
+		try(page_alloc_user(&pp));
+	}
+	if (begin < end) {
+		void *dst = kmap(pp);
+		lazy_seg_read(ls, dst + (begin - va), begin - ls->ls_va, end - begin);
+		kunmap(dst);
+	}
+	if ((r = page_insert(e->env_pgdir, e->env_asid, pp, va, ls->ls_perm)) != 0) {
+		page_free(pp);
+	}
+	return r;
+}
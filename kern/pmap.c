@@ -1,20 +1,33 @@
 #include <bitops.h>
 #include <env.h>
+#include <kmalloc.h>
+#include <ksm.h>
 #include <malta.h>
 #include <mmu.h>
 #include <pmap.h>
 #include <printk.h>
+#include <swap.h>
 
 /* These variables are set by mips_detect_memory(ram_low_size); */
 static u_long memsize; /* Maximum physical address */
 u_long npage;	       /* Amount of memory(in pages) */
+u_long npage_low;      /* Pages below highmem, see 'mips_detect_highmem' */
 
 Pde *cur_pgdir;
 
 struct Page *pages;
 static u_long freemem;
 
-struct Page_list page_free_list; /* Free list of physical pages */
+struct Page_free_area page_free_area; /* Free lists of physical pages, by block order */
+struct Page *zero_page;		      /* The shared page of zeros, see 'zero_page_get' */
+
+static struct Rmap_list rmap_free_list; /* Unused reverse mappings, see 'page_rmap_add' */
+
+static struct Page_list highmem_free; /* Free highmem pages, see 'page_alloc_user' */
+static u_long highmem_nfree;
+static u_int kmap_top; /* The 'kmap' slots in use, see 'kmap' */
+
+u_long pgtable_npage; /* Pages with 'PP_PGTABLE' */
 
 /* Overview:
  *   Use '_memsize' from bootloader to initialize 'memsize' and
@@ -27,9 +40,56 @@ void mips_detect_memory(u_int _memsize) {
 	/* Step 2: Calculate the corresponding 'npage' value. */
 	/* Exercise 2.1: Your code here. */
 	npage = memsize / PAGE_SIZE;
+	npage_low = npage;
 	printk("Memory size: %lu KiB, number of pages: %lu\n", memsize / 1024, npage);
 }
 
+/* Overview:
+ *   Look for the total size of the RAM in the environment 'penv' passed by the bootloader
+ *   ("ememsize", in decimal or in hex with "0x"), and grow 'npage' to cover the RAM beyond
+ *   'memsize' as highmem.
+ *
+ * Pre-Condition:
+ *   'mips_detect_memory' has been called, and 'mips_vm_init' hasn't.
+ *
+ * Hint: 'pages' must fit in 'UPAGES_SIZE', and Malta shows at most 2 GiB of RAM at
+ *   'HIGHMEM_PA_BASE'.
+ */
+void mips_detect_highmem(char **penv) {
+	u_long total = 0;
+
+	for (; penv != NULL && penv[0] != NULL && penv[1] != NULL; penv += 2) {
+		if (strcmp(penv[0], "ememsize") == 0) {
+			const char *s = penv[1];
+			u_int base = 10;
+			if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+				base = 16;
+				s += 2;
+			}
+			for (; *s != '\0'; s++) {
+				u_int d;
+				if (*s >= '0' && *s <= '9') {
+					d = *s - '0';
+				} else if (base == 16 && (*s | 0x20) >= 'a' && (*s | 0x20) <= 'f') {
+					d = (*s | 0x20) - 'a' + 10;
+				} else {
+					break;
+				}
+				total = total * base + d;
+			}
+			break;
+		}
+	}
+
+	total = MIN(total / PAGE_SIZE, UPAGES_SIZE / sizeof(struct Page));
+	total = MIN(total, (0x100000000ULL - HIGHMEM_PA_BASE) / PAGE_SIZE);
+	if (total > npage_low) {
+		npage = total;
+		printk("Highmem size: %lu KiB, number of pages: %lu\n",
+		       (npage - npage_low) * (PAGE_SIZE / 1024), npage);
+	}
+}
+
 /* Lab 2 Key Code "alloc" */
 /* Overview:
     Allocate `n` bytes physical memory with alignment `align`, if `clear` is set, clear the
@@ -77,38 +137,265 @@ void mips_vm_init() {
 	/* Allocate proper size of physical memory for global array `pages`,
 	 * for physical memory management. Then, map virtual address `UPAGES` to
 	 * physical address `pages` allocated before. For consideration of alignment,
-	 * you should round up the memory size before map. */
-	pages = (struct Page *)alloc(npage * sizeof(struct Page), PAGE_SIZE, 1);
+	 * you should round up the memory size before map. `pages` is aligned so that
+	 * `UPAGES` can be mapped with superpages. */
+	pages = (struct Page *)alloc(npage * sizeof(struct Page), HUGE_PAGE_SIZE, 1);
 	printk("to memory %x for struct Pages.\n", freemem);
+
+	/* The reverse mappings don't come from 'kmalloc' as long as this pool lasts, so that
+	 * mapping a page seldom needs a free page more than 'page_insert' already does. */
+	struct Rmap *rmaps = alloc(npage * RMAP_PER_PAGE * sizeof(struct Rmap), 4, 0);
+	LIST_INIT(&rmap_free_list);
+	for (u_long i = 0; i < npage * RMAP_PER_PAGE; i++) {
+		LIST_INSERT_HEAD(&rmap_free_list, &rmaps[i], rm_link);
+	}
 	printk("pmap.c:\t mips vm init success\n");
 }
 
 /* Overview:
- *   Initialize page structure and memory free list. The 'pages' array has one 'struct Page' entry
- * per physical page. Pages are reference counted, and free pages are kept on a linked list.
+ *   Reset every free list of 'pfa' to empty.
+ */
+static void page_free_area_init(struct Page_free_area *pfa) {
+	for (int i = 0; i <= PAGE_MAX_ORDER; i++) {
+		LIST_INIT(&pfa->pf_list[i]);
+	}
+	pfa->pf_npage = 0;
+	LIST_INIT(&pfa->pf_zero);
+	pfa->pf_nzero = 0;
+}
+
+/* Overview:
+ *   Put the free block of 2^'order' pages starting at 'pp' on its free list.
+ */
+static void free_block_insert(struct Page *pp, u_int order) {
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	LIST_INSERT_HEAD(&page_free_area.pf_list[order], pp, pp_link);
+	page_free_area.pf_npage += 1UL << order;
+}
+
+/* Overview:
+ *   Take the free block starting at 'pp' off its free list.
+ */
+static void free_block_remove(struct Page *pp) {
+	LIST_REMOVE(pp, pp_link);
+	pp->pp_flags &= ~PP_FREE;
+	page_free_area.pf_npage -= 1UL << pp->pp_order;
+}
+
+/* Overview:
+ *   Make the 'kmap' slots wired TLB entries, so that 'tlbwr' never evicts them, and leave
+ *   them all invalid.
+ */
+static void kmap_init(void) {
+	tlb_set_wired(KMAP_NSLOT);
+	for (u_int i = 0; i < KMAP_NSLOT; i++) {
+		tlb_write_wired(i, KMAP_BASE + i * 2 * PAGE_SIZE, 0, 0);
+	}
+}
+
+/* Overview:
+ *   Initialize page structure and memory free lists. The 'pages' array has one 'struct Page'
+ * entry per physical page. Pages are reference counted, and free pages are kept as naturally
+ * aligned power-of-two blocks on the lists of 'page_free_area', one list per block order.
  *
- * Hint: Use 'LIST_INSERT_HEAD' to insert free pages to 'page_free_list'.
+ * Hint: Every free page below highmem ends up in the largest aligned block that fits below
+ *   'npage_low'. Highmem pages are kept apart, one by one, for 'page_alloc_user'.
  */
 void page_init(void) {
-	/* Step 1: Initialize page_free_list. */
-	/* Hint: Use macro `LIST_INIT` defined in include/queue.h. */
-	/* Exercise 2.3: Your code here. (1/4) */
-	LIST_INIT(&page_free_list);
+	/* Step 1: Initialize the free lists. */
+	page_free_area_init(&page_free_area);
 	/* Step 2: Align `freemem` up to multiple of PAGE_SIZE. */
-	/* Exercise 2.3: Your code here. (2/4) */
 	freemem = ROUND(freemem, PAGE_SIZE);
 	/* Step 3: Mark all memory below `freemem` as used (set `pp_ref` to 1) */
-	/* Exercise 2.3: Your code here. (3/4) */
 	u_long count = PPN(PADDR(freemem));
 	for (u_long i = 0; i < count; i++) {
 		pages[i].pp_ref = 1;
+		pages[i].pp_flags = 0;
 	}
-	/* Step 4: Mark the other memory as free. */
-	/* Exercise 2.3: Your code here. (4/4) */
+	/* Step 4: Mark the other memory as free, carving it into the largest aligned blocks. */
 	for (u_long i = count; i < npage; i++) {
 		pages[i].pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
+		pages[i].pp_flags = 0;
+	}
+	for (u_long i = 0; i < npage; i++) {
+		LIST_INIT(&pages[i].pp_rmap);
+	}
+	for (u_long i = count; i < npage_low;) {
+		u_int order = PAGE_MAX_ORDER;
+		while ((i & ((1UL << order) - 1)) != 0 || i + (1UL << order) > npage_low) {
+			order--;
+		}
+		free_block_insert(&pages[i], order);
+		i += 1UL << order;
+	}
+	/* Step 5: Put the highmem pages on their own list, the lowest first. */
+	LIST_INIT(&highmem_free);
+	highmem_nfree = 0;
+	for (u_long i = npage; i-- > npage_low;) {
+		page_free_pages(&pages[i], 0);
+	}
+	if (npage > npage_low) {
+		kmap_init();
+	}
+}
+
+/* Overview:
+ *   Take a free block of 2^'order' pages off the free lists, splitting a larger one if needed.
+ *   The contents of the block are left as they are.
+ */
+static int buddy_alloc(struct Page **new, u_int order) {
+	struct Page *pp;
+	u_int k;
+
+	/* Step 1: Find the smallest free block that can hold the request. */
+	for (k = order; k <= PAGE_MAX_ORDER; k++) {
+		if (!LIST_EMPTY(&page_free_area.pf_list[k])) {
+			break;
+		}
+	}
+	if (k > PAGE_MAX_ORDER) {
+		return -E_NO_MEM;
+	}
+	pp = LIST_FIRST(&page_free_area.pf_list[k]);
+	free_block_remove(pp);
+
+	/* Step 2: Split it, keeping the lower half and freeing the upper half each time. */
+	while (k > order) {
+		k--;
+		free_block_insert(pp + (1UL << k), k);
 	}
+	*new = pp;
+	return 0;
+}
+
+/* Overview:
+ *   Take the first page of the pre-zeroed pool, or return NULL if the pool is empty.
+ */
+static struct Page *zero_pool_get(void) {
+	struct Page *pp = LIST_FIRST(&page_free_area.pf_zero);
+
+	if (pp != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		pp->pp_flags &= ~PP_ZERO;
+		page_free_area.pf_nzero--;
+	}
+	return pp;
+}
+
+/* Overview:
+ *   Allocate 2^'order' physically contiguous pages from free memory, and fill them with zero.
+ *   The block is aligned to its own size.
+ *
+ * Post-Condition:
+ *   If there's no free block large enough, return -E_NO_MEM.
+ *   Otherwise, set the address of the first 'Page' of the block to *pp, and return 0.
+ *
+ * Note:
+ *   As with 'page_alloc', the reference counts of the pages are NOT increased. The block must be
+ *   given back as a whole with 'page_free_pages' and the same 'order'.
+ */
+int page_alloc_pages(struct Page **new, u_int order) {
+	struct Page *pp;
+
+	if (order > PAGE_MAX_ORDER) {
+		return -E_INVAL;
+	}
+
+	if (buddy_alloc(&pp, order) != 0) {
+		/* Pages parked in the pre-zeroed pool may complete a block: give them back and
+		 * try once more. */
+		while ((pp = zero_pool_get()) != NULL) {
+			page_free_pages(pp, 0);
+		}
+		/* A single page can also be won back by swapping a cold user page out. */
+		while (buddy_alloc(&pp, order) != 0) {
+			if (order != 0 || swap_out() != 0) {
+				return -E_NO_MEM;
+			}
+		}
+	}
+
+	memset((void *)page2kva(pp), 0, PAGE_SIZE << order);
+	*new = pp;
+	return 0;
+}
+
+/* Overview:
+ *   Release the block of 2^'order' pages starting at 'pp', merging it with its free buddies.
+ *
+ * Pre-Condition:
+ *   The block was returned by 'page_alloc_pages' with the same 'order', and 'pp->pp_ref' is '0'.
+ */
+void page_free_pages(struct Page *pp, u_int order) {
+	u_long ppn = page2ppn(pp);
+
+	assert(pp->pp_ref == 0);
+	assert(order <= PAGE_MAX_ORDER && (ppn & ((1UL << order) - 1)) == 0);
+
+	if (pp->pp_flags & PP_PGTABLE) {
+		pp->pp_flags &= ~PP_PGTABLE;
+		pgtable_npage--;
+	}
+	if (ppn >= npage_low) {
+		assert(order == 0);
+		pp->pp_flags |= PP_FREE;
+		LIST_INSERT_HEAD(&highmem_free, pp, pp_link);
+		highmem_nfree++;
+		return;
+	}
+
+	while (order < PAGE_MAX_ORDER) {
+		u_long buddy = ppn ^ (1UL << order);
+		if (buddy >= npage_low || !(pages[buddy].pp_flags & PP_FREE) ||
+		    pages[buddy].pp_order != order) {
+			break;
+		}
+		free_block_remove(&pages[buddy]);
+		ppn &= ~(1UL << order);
+		order++;
+	}
+	free_block_insert(&pages[ppn], order);
+}
+
+/* Overview:
+ *   Move every free block into 'saved', leaving no free memory behind. Used by the checks to
+ *   exercise out-of-memory paths.
+ *
+ * Post-Condition:
+ *   The stolen blocks no longer count as free, so pages freed in the meantime are never merged
+ *   into them. Give them back with 'page_free_area_restore'.
+ */
+void page_free_area_steal(struct Page_free_area *saved) {
+	struct Page *pp;
+
+	page_free_area_init(saved);
+	for (int i = 0; i <= PAGE_MAX_ORDER; i++) {
+		while ((pp = LIST_FIRST(&page_free_area.pf_list[i])) != NULL) {
+			free_block_remove(pp);
+			LIST_INSERT_HEAD(&saved->pf_list[i], pp, pp_link);
+			saved->pf_npage += 1UL << i;
+		}
+	}
+	while ((pp = zero_pool_get()) != NULL) {
+		LIST_INSERT_HEAD(&saved->pf_list[0], pp, pp_link);
+		saved->pf_npage++;
+	}
+}
+
+/* Overview:
+ *   Free every block previously taken by 'page_free_area_steal' into 'saved'.
+ */
+void page_free_area_restore(struct Page_free_area *saved) {
+	struct Page *pp;
+
+	for (int i = 0; i <= PAGE_MAX_ORDER; i++) {
+		while ((pp = LIST_FIRST(&saved->pf_list[i])) != NULL) {
+			LIST_REMOVE(pp, pp_link);
+			page_free_pages(pp, i);
+		}
+	}
+	saved->pf_npage = 0;
 }
 
 /* Overview:
@@ -122,26 +409,124 @@ void page_init(void) {
  *   This does NOT increase the reference count 'pp_ref' of the page - the caller must do these if
  *   necessary (either explicitly or via page_insert).
  *
- * Hint: Use LIST_FIRST and LIST_REMOVE defined in include/queue.h.
+ * Hint: Pages from the pre-zeroed pool are already clean and are returned without 'memset'.
+ *   A page full of zeros has no entry in use, should it become a page table.
  */
 int page_alloc(struct Page **new) {
-	/* Step 1: Get a page from free memory. If fails, return the error code.*/
 	struct Page *pp;
-	/* Exercise 2.4: Your code here. (1/2) */
-	if (LIST_EMPTY(&page_free_list)) {
-		return -E_NO_MEM;
+
+	if ((pp = zero_pool_get()) == NULL) {
+		try(page_alloc_pages(&pp, 0));
 	}
-	pp = LIST_FIRST(&page_free_list);
-	LIST_REMOVE(pp, pp_link);
+	pp->pp_npte = 0;
+	*new = pp;
+	return 0;
+}
 
-	/* Step 2: Initialize this page with zero.
-	 * Hint: use `memset`. */
-	/* Exercise 2.4: Your code here. (2/2) */
-	memset((void*)page2kva(pp), 0, PAGE_SIZE);
+/* Overview:
+ *   Allocate a physical page like 'page_alloc', but leave its old contents in place.
+ *
+ * Pre-Condition:
+ *   The caller overwrites the whole page before any of it can be seen by user space.
+ *
+ * Hint: The pre-zeroed pool is only touched when nothing else is free, so zeroing work done
+ *   ahead of time is not spent on pages that are about to be overwritten anyway.
+ */
+int page_alloc_nozero(struct Page **new) {
+	if (buddy_alloc(new, 0) == 0) {
+		(*new)->pp_npte = 0;
+		return 0;
+	}
+	return page_alloc(new);
+}
+
+/* Overview:
+ *   Allocate a physical page for user space, and fill it with zero. Highmem pages are handed
+ *   out first, so that the memory the kernel can reach directly is kept for itself (page
+ *   tables, 'kmalloc' and so on).
+ *
+ * Post-Condition:
+ *   Same as 'page_alloc'.
+ *
+ * Note:
+ *   The page may not be reachable through KSEG0: use 'kmap' rather than 'page2kva' to access
+ *   it.
+ */
+int page_alloc_user(struct Page **new) {
+	void *va;
+
+	// below highmem, 'page_alloc' zeroes the page, or takes it from the pre-zeroed pool
+	if (LIST_EMPTY(&highmem_free)) {
+		return page_alloc(new);
+	}
+	try(page_alloc_user_nozero(new));
+	if (page_is_highmem(*new)) {
+		va = kmap(*new);
+		memset(va, 0, PAGE_SIZE);
+		kunmap(va);
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Allocate a physical page for user space like 'page_alloc_user', but leave its old contents
+ *   in place.
+ *
+ * Pre-Condition:
+ *   Same as 'page_alloc_nozero'.
+ */
+int page_alloc_user_nozero(struct Page **new) {
+	struct Page *pp;
+
+	if ((pp = LIST_FIRST(&highmem_free)) == NULL) {
+		return page_alloc_nozero(new);
+	}
+	LIST_REMOVE(pp, pp_link);
+	pp->pp_flags &= ~PP_FREE;
+	highmem_nfree--;
+	pp->pp_npte = 0;
 	*new = pp;
 	return 0;
 }
 
+/* Overview:
+ *   Return a kernel address of the page 'pp'. A page below highmem is simply reached through
+ *   KSEG0. A highmem page gets mapped at the next free slot in KSEG2 until 'kunmap'.
+ *
+ * Pre-Condition:
+ *   At most 'KMAP_NSLOT' highmem pages are mapped at a time, and they're unmapped in the
+ *   reverse order ('kunmap' the last 'kmap' first).
+ *
+ * Hint: The TLB entry of a slot maps the page in its even half and nothing in its odd half,
+ *   both global (the G bit only counts if it's set in both).
+ */
+void *kmap(struct Page *pp) {
+	u_long va;
+
+	if (!page_is_highmem(pp)) {
+		return (void *)page2kva(pp);
+	}
+	panic_on(kmap_top >= KMAP_NSLOT);
+	va = KMAP_BASE + kmap_top * 2 * PAGE_SIZE;
+	tlb_write_wired(kmap_top, va,
+			(page2pa(pp) | PTE_C_CACHEABLE | PTE_D | PTE_V | PTE_G) >> PTE_HARDFLAG_SHIFT,
+			PTE_G >> PTE_HARDFLAG_SHIFT);
+	kmap_top++;
+	return (void *)va;
+}
+
+/* Overview:
+ *   Undo the 'kmap' that returned 'va'. Does nothing for an address in KSEG0.
+ */
+void kunmap(void *va) {
+	if ((u_long)va < KMAP_BASE) {
+		return;
+	}
+	assert(kmap_top > 0 && (u_long)va == KMAP_BASE + (kmap_top - 1) * 2 * PAGE_SIZE);
+	kmap_top--;
+	tlb_write_wired(kmap_top, (u_long)va, 0, 0);
+}
+
 /* Overview:
  *   Release a page 'pp', mark it as free.
  *
@@ -149,10 +534,131 @@ int page_alloc(struct Page **new) {
  *   'pp->pp_ref' is '0'.
  */
 void page_free(struct Page *pp) {
-	assert(pp->pp_ref == 0);
-	/* Just insert it into 'page_free_list'. */
-	/* Exercise 2.5: Your code here. */
-	LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+	page_free_pages(pp, 0);
+}
+
+/* Overview:
+ *   Zero up to 'n' free pages and move them to the pre-zeroed pool, stopping once the pool holds
+ *   'PAGE_ZERO_POOL_MAX' pages. Meant to be called when the CPU would otherwise sit idle.
+ */
+void page_zero_refill(u_int n) {
+	struct Page *pp;
+
+	while (n-- > 0 && page_free_area.pf_nzero < PAGE_ZERO_POOL_MAX) {
+		if (buddy_alloc(&pp, 0) != 0) {
+			return;
+		}
+		memset((void *)page2kva(pp), 0, PAGE_SIZE);
+		pp->pp_flags |= PP_ZERO;
+		LIST_INSERT_HEAD(&page_free_area.pf_zero, pp, pp_link);
+		page_free_area.pf_nzero++;
+	}
+}
+
+/* Overview:
+ *   Return the page full of zeros shared by all mappings of memory that was never written.
+ *   It's allocated on first use and never freed. It can only be mapped read-only: a write
+ *   through a copy-on-write mapping of it gets a fresh page instead.
+ */
+struct Page *zero_page_get(void) {
+	if (zero_page == NULL) {
+		panic_on(page_alloc(&zero_page));
+		zero_page->pp_ref = 1;
+	}
+	return zero_page;
+}
+
+/* Overview:
+ *   Add 'd' (1 or -1) to the 'pp_nshared' count of the page table of the entry mapping 'pp'
+ *   other than 'pte', if there's one. 'pp' must be mapped by at most one other entry.
+ */
+static void pte_share_other(struct Page *pp, Pte *pte, int d) {
+	struct Rmap *rm;
+	Pde pde;
+	Pte *other;
+
+	LIST_FOREACH (rm, &pp->pp_rmap, rm_link) {
+		if (!((pde = rm->rm_pgdir[PDX(rm->rm_va)]) & PTE_V)) {
+			continue;
+		}
+		other = (Pte *)KADDR(PTE_ADDR(pde)) + PTX(rm->rm_va);
+		if (other != pte && (*other & PTE_V) && pa2page(*other) == pp) {
+			pa2page(PADDR(other))->pp_nshared += d;
+			return;
+		}
+	}
+}
+
+/* Overview:
+ *   Count one entry more ('d' = 1) or less ('d' = -1) mapping 'pp', the one at 'pte'. An entry
+ *   is shared while its page is mapped by another entry too (the zero page always is), so the
+ *   second mapping of a page makes the first one shared as well, and so on.
+ */
+static void pte_share(struct Page *pp, Pte *pte, int d) {
+	struct Page *pt = pa2page(PADDR(pte));
+
+	if (pp == zero_page) {
+		pt->pp_nshared += d;
+		return;
+	}
+	if (d < 0) {
+		pp->pp_npte--;
+	}
+	if (pp->pp_npte >= 1) {
+		pt->pp_nshared += d;
+	}
+	if (pp->pp_npte == 1) {
+		pte_share_other(pp, pte, d);
+	}
+	if (d > 0) {
+		pp->pp_npte++;
+	}
+}
+
+/* Overview:
+ *   Write 'val' to the page table entry 'pte', keeping the counts of its page table up to date:
+ *   the entries in use, and those swapped out, copy-on-write and shared (see 'mem_stat').
+ *
+ * Hint:
+ *   All the user page table entries are written through here.
+ */
+void pte_set(Pte *pte, Pte val) {
+	struct Page *pt = pa2page(PADDR(pte));
+	Pte old = *pte;
+
+	pt->pp_npte += (val != 0) - (old != 0);
+	pt->pp_nswap += PTE_IS_SWAP(val) - PTE_IS_SWAP(old);
+	pt->pp_ncow += ((val & (PTE_V | PTE_COW)) == (PTE_V | PTE_COW)) -
+		       ((old & (PTE_V | PTE_COW)) == (PTE_V | PTE_COW));
+	if ((old & PTE_V) && (!(val & PTE_V) || PTE_ADDR(val) != PTE_ADDR(old))) {
+		pte_share(pa2page(old), pte, -1);
+	}
+	if ((val & PTE_V) && (!(old & PTE_V) || PTE_ADDR(val) != PTE_ADDR(old))) {
+		pte_share(pa2page(val), pte, 1);
+	}
+	*pte = val;
+}
+
+/* Overview:
+ *   Take the page table of 'va' out of 'pgdir' if no entry is in use in it any more, and return
+ *   it, still referenced, so that the caller drops the TLB entry mapping it at 'UVPT' before
+ *   freeing it. Return NULL if it's still in use, or if there's none.
+ *
+ * Hint:
+ *   Page tables above 'UTOP' are shared by all envs, and are never taken out.
+ */
+static struct Page *pgtable_unlink(Pde *pgdir, u_long va) {
+	struct Page *pt;
+
+	if (va >= UTOP || !(pgdir[PDX(va)] & PTE_V)) {
+		return NULL;
+	}
+	pt = pa2page(pgdir[PDX(va)]);
+	if (pt->pp_npte != 0) {
+		return NULL;
+	}
+	pgdir[PDX(va)] = 0;
+	return pt;
 }
 
 /* Overview:
@@ -195,6 +701,7 @@ static int pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte) {
 			}
 		
 			pp->pp_ref++;
+			page_set_pgtable(pp);
 
 			*pgdir_entryp = page2pa(pp) | (PTE_C_CACHEABLE | PTE_V);
 			pgdir_entry_data = *pgdir_entryp;
@@ -211,13 +718,188 @@ static int pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte) {
 	return 0;
 }
 
+/* Overview:
+ *   Clear 'PTE_HUGE' in every entry of the superpage containing 'va', whose page table entry is
+ *   '*pte', leaving the large TLB entry that may still map it to the caller.
+ */
+static void page_demote_pte(Pte *pte, u_long va) {
+	Pte *base = pte - (PTX(va) & (HUGE_PAIR_NPTE - 1));
+
+	for (int i = 0; i < HUGE_PAIR_NPTE; i++) {
+		base[i] &= ~PTE_HUGE;
+	}
+}
+
+/* Overview:
+ *   Split the superpage containing 'va', whose page table entry is '*pte', back into ordinary
+ *   pages. Does nothing if 'va' is not part of a superpage.
+ *
+ * Hint:
+ *   Every change to one entry of a superpage must go through here first, so that the TLB never
+ *   keeps translating the range with the stale large entry.
+ */
+static void page_demote(Pte *pte, u_int asid, u_long va) {
+	if (!(*pte & PTE_HUGE)) {
+		return;
+	}
+	page_demote_pte(pte, va);
+	// a probe for any address in the range hits the large entry
+	tlb_invalidate(asid, va);
+}
+
+/* Overview:
+ *   Turn the 'HUGE_PAIR_SIZE'-aligned range at 'va' into a superpage, so that the TLB refill
+ *   maps it with one entry pair of 'HUGE_PAGE_SIZE' pages.
+ *
+ * Post-Condition:
+ *   Return 0 on success.
+ *   Return -E_INVAL if 'va' is misaligned, or if not every page in the range is mapped with the
+ *   same permission, or if either half is not physically contiguous and 'HUGE_PAGE_SIZE'
+ *   aligned. The mappings are left untouched in that case.
+ */
+int page_promote(Pde *pgdir, u_int asid, u_long va) {
+	Pte *pte;
+
+	if (va % HUGE_PAIR_SIZE != 0) {
+		return -E_INVAL;
+	}
+	pgdir_walk(pgdir, va, 0, &pte);
+	if (pte == NULL) {
+		return -E_INVAL;
+	}
+
+	/* Step 1: Check that the range can be described by two large pages. */
+	for (int i = 0; i < HUGE_PAIR_NPTE; i++) {
+		Pte half = pte[i & ~(HUGE_PAIR_NPTE / 2 - 1)];
+		if (!(pte[i] & PTE_V) || PTE_FLAGS(pte[i]) != PTE_FLAGS(pte[0])) {
+			return -E_INVAL;
+		}
+		if (PTE_ADDR(half) % HUGE_PAGE_SIZE != 0 ||
+		    PTE_ADDR(pte[i]) != PTE_ADDR(half) + (i % (HUGE_PAIR_NPTE / 2)) * PAGE_SIZE) {
+			return -E_INVAL;
+		}
+	}
+
+	/* Step 2: Drop the small entries the TLB may hold for the range, then mark it. */
+	for (int i = 0; i < HUGE_PAIR_NPTE; i += 2) {
+		tlb_invalidate(asid, va + i * PAGE_SIZE);
+	}
+	for (int i = 0; i < HUGE_PAIR_NPTE; i++) {
+		pte[i] |= PTE_HUGE;
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Add 'RMAP_GROW' reverse mappings from 'kmalloc' to the pool. They stay in it for good.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_NO_MEM if 'kmalloc' fails.
+ */
+static int rmap_grow(void) {
+	struct Rmap *rmaps;
+
+	if ((rmaps = kmalloc(RMAP_GROW * sizeof(struct Rmap))) == NULL) {
+		return -E_NO_MEM;
+	}
+	for (int i = 0; i < RMAP_GROW; i++) {
+		LIST_INSERT_HEAD(&rmap_free_list, &rmaps[i], rm_link);
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Record that the page at 'va' in 'pgdir' maps 'pp'. Nothing is recorded for the zero page,
+ *   which is never unmapped everywhere and may be mapped more often than any other page.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_NO_MEM if the pool of reverse mappings is exhausted and can't
+ *   grow, that is, if there's no free memory left either.
+ */
+int page_rmap_add(struct Page *pp, Pde *pgdir, u_long va) {
+	struct Rmap *rm;
+
+	if (pp == zero_page) {
+		return 0;
+	}
+	if (LIST_EMPTY(&rmap_free_list)) {
+		try(rmap_grow());
+	}
+	rm = LIST_FIRST(&rmap_free_list);
+	LIST_REMOVE(rm, rm_link);
+	rm->rm_pgdir = pgdir;
+	rm->rm_va = ROUNDDOWN(va, PAGE_SIZE);
+	LIST_INSERT_HEAD(&pp->pp_rmap, rm, rm_link);
+	return 0;
+}
+
+/* Overview:
+ *   Forget that the page at 'va' in 'pgdir' maps 'pp', as its page table entry is about to be
+ *   cleared (or to map something else).
+ */
+void page_rmap_remove(struct Page *pp, Pde *pgdir, u_long va) {
+	struct Rmap *rm;
+
+	va = ROUNDDOWN(va, PAGE_SIZE);
+	LIST_FOREACH (rm, &pp->pp_rmap, rm_link) {
+		if (rm->rm_pgdir == pgdir && rm->rm_va == va) {
+			LIST_REMOVE(rm, rm_link);
+			LIST_INSERT_HEAD(&rmap_free_list, rm, rm_link);
+			return;
+		}
+	}
+	assert(pp == zero_page);
+}
+
+/* Overview:
+ *   Unmap the page 'pp' from every address space that maps it, and drop the references these
+ *   mappings held. This takes time proportional to the number of mappings, however many envs
+ *   there are.
+ *
+ * Post-Condition:
+ *   Return the number of mappings removed. 'pp' itself is freed if nothing else refers to it,
+ *   and so are the page tables left empty below 'UTOP'.
+ *
+ * Hint:
+ *   A page table doesn't tell which ASID it's used with, so instead of probing the TLB for
+ *   each mapping, it's swept once for every entry translating to 'pp', whatever its ASID.
+ */
+int page_unmap_all(struct Page *pp) {
+	struct Page *pt;
+	struct Rmap *rm;
+	Pte *pte;
+	int n = 0;
+
+	assert(pp != zero_page);
+	while ((rm = LIST_FIRST(&pp->pp_rmap)) != NULL) {
+		pgdir_walk(rm->rm_pgdir, rm->rm_va, 0, &pte);
+		assert(pte != NULL && (*pte & PTE_V) && pa2page(*pte) == pp);
+		if (*pte & PTE_HUGE) {
+			page_demote_pte(pte, rm->rm_va);
+		}
+		pte_set(pte, 0);
+		if ((pt = pgtable_unlink(rm->rm_pgdir, rm->rm_va)) != NULL) {
+			tlb_flush_pa(page2pa(pt));
+			page_decref(pt);
+		}
+		LIST_REMOVE(rm, rm_link);
+		LIST_INSERT_HEAD(&rmap_free_list, rm, rm_link);
+		n++;
+	}
+	tlb_flush_pa(page2pa(pp));
+	for (int i = 0; i < n; i++) {
+		page_decref(pp);
+	}
+	return n;
+}
+
 /* Overview:
  *   Map the physical page 'pp' at virtual address 'va'. The permission (the low 12 bits) of the
  *   page table entry should be set to 'perm | PTE_C_CACHEABLE | PTE_V'.
  *
  * Post-Condition:
  *   Return 0 on success
- *   Return -E_NO_MEM, if page table couldn't be allocated
+ *   Return -E_NO_MEM, if page table or reverse mapping couldn't be allocated
  *
  * Hint:
  *   If there is already a page mapped at `va`, call page_remove() to release this mapping.
@@ -226,6 +908,13 @@ static int pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte) {
 int page_insert(Pde *pgdir, u_int asid, struct Page *pp, u_long va, u_int perm) {
 	Pte *pte;
 
+	// only 'page_promote' may build superpages
+	perm &= ~PTE_HUGE;
+	// neither the zero page nor a merged page may be written to
+	if ((pp == zero_page || (pp->pp_flags & PP_KSM)) && (perm & PTE_D)) {
+		perm = (perm & ~PTE_D) | PTE_COW;
+	}
+
 	/* Step 1: Get corresponding page table entry. */
 	pgdir_walk(pgdir, va, 0, &pte);
 
@@ -233,10 +922,14 @@ int page_insert(Pde *pgdir, u_int asid, struct Page *pp, u_long va, u_int perm)
 		if (pa2page(*pte) != pp) {
 			page_remove(pgdir, asid, va);
 		} else {
+			page_demote(pte, asid, va);
 			tlb_invalidate(asid, va);
-			*pte = page2pa(pp) | perm | PTE_C_CACHEABLE | PTE_V;
+			pte_set(pte, page2pa(pp) | perm | PTE_C_CACHEABLE | PTE_V);
 			return 0;
 		}
+	} else if (pte && PTE_IS_SWAP(*pte)) {
+		swap_free(*pte);
+		pte_set(pte, 0);
 	}
 
 	/* Step 2: Flush TLB with 'tlb_invalidate'. */
@@ -245,15 +938,21 @@ int page_insert(Pde *pgdir, u_int asid, struct Page *pp, u_long va, u_int perm)
 	/* Step 3: Re-get or create the page table entry. */
 	/* If failed to create, return the error. */
 	/* Exercise 2.7: Your code here. (2/3) */
+	/* Hint: 'pp' is referenced first, so that it can't be swapped out to make room for the
+	 * page table. */
+	(pp->pp_ref)++;
 	int return_code = pgdir_walk(pgdir, va, 1, &pte);
+	if (return_code == 0) {
+		return_code = page_rmap_add(pp, pgdir, va);
+	}
 	if (return_code == -E_NO_MEM) {
+		(pp->pp_ref)--;
 		return -E_NO_MEM;
 	}
 	/* Step 4: Insert the page to the page table entry with 'perm | PTE_C_CACHEABLE | PTE_V'
 	 * and increase its 'pp_ref'. */
 	/* Exercise 2.7: Your code here. (3/3) */
-	*pte = page2pa(pp) | perm | PTE_C_CACHEABLE | PTE_V;
-	(pp->pp_ref)++;
+	pte_set(pte, page2pa(pp) | perm | PTE_C_CACHEABLE | PTE_V);
 	return 0;
 }
 
@@ -295,6 +994,8 @@ void page_decref(struct Page *pp) {
 
 	/* If 'pp_ref' reaches to 0, free this page. */
 	if (--pp->pp_ref == 0) {
+		assert(LIST_EMPTY(&pp->pp_rmap));
+		ksm_unmerge(pp);
 		page_free(pp);
 	}
 }
@@ -308,22 +1009,107 @@ void page_remove(Pde *pgdir, u_int asid, u_long va) {
 	/* Step 1: Get the page table entry, and check if the page table entry is valid. */
 	struct Page *pp = page_lookup(pgdir, va, &pte);
 	if (pp == NULL) {
+		// a page swapped out only holds its swap slot
+		pgdir_walk(pgdir, va, 0, &pte);
+		if (pte && PTE_IS_SWAP(*pte)) {
+			swap_free(*pte);
+			pte_set(pte, 0);
+		}
 		return;
 	}
 
+	page_demote(pte, asid, va);
+
 	/* Step 2: Decrease reference count on 'pp'. */
+	page_rmap_remove(pp, pgdir, va);
 	page_decref(pp);
 
 	/* Step 3: Flush TLB. */
-	*pte = 0;
+	pte_set(pte, 0);
 	tlb_invalidate(asid, va);
 	return;
 }
 /* End of Key Code "page_remove" */
 
+/* Overview:
+ *   Unmap the page at 'va' like 'page_remove', and free its page table as well if no entry is
+ *   in use in it any more, so that envs mapping and unmapping a lot don't pin empty page tables
+ *   until they're freed. 'page_remove' itself keeps the page table, as the checks of lab 2
+ *   expect.
+ *
+ * Hint:
+ *   The page table is also mapped at 'UVPT' in the address space, through an entry of its own
+ *   in the TLB.
+ */
+void page_unmap(Pde *pgdir, u_int asid, u_long va) {
+	struct Page *pt;
+
+	page_remove(pgdir, asid, va);
+	if ((pt = pgtable_unlink(pgdir, va)) != NULL) {
+		tlb_invalidate(asid, UVPT + (PDX(va) << PGSHIFT));
+		page_decref(pt);
+	}
+}
+
+/* Overview:
+ *   Fill in 'st' with the memory usage of the whole system and, unless 'pgdir' is NULL, with
+ *   the pages mapped or swapped out in [va, va + len) of 'pgdir'.
+ *
+ * Pre-Condition:
+ *   'va + len' doesn't wrap around. Only the part of the range below UTOP is looked at.
+ *
+ * Hint:
+ *   The counts of a page table wholly in the range are kept up to date by 'pte_set', so only
+ *   the entries of the page tables at either end of the range are looked at one by one.
+ */
+void mem_stat(Pde *pgdir, u_long va, u_long len, struct Mem_stat *st) {
+	u_long end = MIN(va + len, UTOP);
+	struct Page *ptp, *pp;
+	Pte *pt, pte;
+
+	memset(st, 0, sizeof(*st));
+	st->ms_npage = npage;
+	st->ms_nhighmem = npage - npage_low;
+	st->ms_nfree = page_free_area.pf_npage + page_free_area.pf_nzero + highmem_nfree;
+	st->ms_nzero = page_free_area.pf_nzero;
+	st->ms_npgtable = pgtable_npage;
+	st->ms_nkmalloc = kmalloc_npage();
+	if (pgdir == NULL) {
+		return;
+	}
+
+	st->ms_nenvpgtable = 1;
+	for (va = ROUNDDOWN(va, PAGE_SIZE); va < end; va = ROUNDDOWN(va, PDMAP) + PDMAP) {
+		if (!(pgdir[PDX(va)] & PTE_V)) {
+			continue;
+		}
+		st->ms_nenvpgtable++;
+		ptp = pa2page(pgdir[PDX(va)]);
+		if (va % PDMAP == 0 && va + PDMAP <= end) {
+			st->ms_nresident += ptp->pp_npte - ptp->pp_nswap;
+			st->ms_nshared += ptp->pp_nshared;
+			st->ms_ncow += ptp->pp_ncow;
+			st->ms_nswap += ptp->pp_nswap;
+			continue;
+		}
+		pt = (Pte *)page2kva(ptp);
+		for (u_long a = va; a < MIN(end, ROUNDDOWN(va, PDMAP) + PDMAP); a += PAGE_SIZE) {
+			pte = pt[PTX(a)];
+			if (pte & PTE_V) {
+				pp = pa2page(pte);
+				st->ms_nresident++;
+				st->ms_nshared += pp == zero_page || pp->pp_npte > 1;
+				st->ms_ncow += (pte & PTE_COW) != 0;
+			} else if (PTE_IS_SWAP(pte)) {
+				st->ms_nswap++;
+			}
+		}
+	}
+}
+
 void physical_memory_manage_check(void) {
 	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page_list fl;
+	struct Page_free_area fl;
 	int *temp;
 
 	// should be able to allocate three pages
@@ -337,9 +1123,8 @@ void physical_memory_manage_check(void) {
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	// now this page_free list must be empty!!!!
-	LIST_INIT(&page_free_list);
+	page_free_area_steal(&fl);
+	// now the free lists must be empty!!!!
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
@@ -359,7 +1144,7 @@ void physical_memory_manage_check(void) {
 	// pp0 should be zero
 	assert(*temp == 0);
 
-	page_free_list = fl;
+	page_free_area_restore(&fl);
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
@@ -406,9 +1191,378 @@ void physical_memory_manage_check(void) {
 	printk("physical_memory_manage_check() succeeded\n");
 }
 
+static u_long free_block_count(u_int order) {
+	struct Page *pp;
+	u_long n = 0;
+
+	LIST_FOREACH (pp, &page_free_area.pf_list[order], pp_link) {
+		n++;
+	}
+	return n;
+}
+
+void buddy_check(void) {
+	struct Page *blk[64];
+	u_int ord[64];
+	u_long nblock[PAGE_MAX_ORDER + 1];
+	u_long nfree = page_free_area.pf_npage;
+	u_int seed = 1;
+	struct Page *pp;
+
+	for (int k = 0; k <= PAGE_MAX_ORDER; k++) {
+		nblock[k] = free_block_count(k);
+	}
+
+	// an order above the maximum should be rejected
+	assert(page_alloc_pages(&pp, PAGE_MAX_ORDER + 1) == -E_INVAL);
+
+	for (int round = 0; round < 8; round++) {
+		// allocate blocks of mixed orders, each aligned to its size and filled with zero
+		for (int i = 0; i < 64; i++) {
+			seed = seed * 1103515245 + 12345;
+			ord[i] = (seed >> 16) % 6;
+			assert(page_alloc_pages(&blk[i], ord[i]) == 0);
+			assert((page2ppn(blk[i]) & ((1 << ord[i]) - 1)) == 0);
+			for (int j = 0; j < (1 << ord[i]); j++) {
+				u_int *p = (u_int *)page2kva(blk[i] + j);
+				assert(p[0] == 0 && p[PAGE_SIZE / sizeof(u_int) - 1] == 0);
+				p[0] = i;
+			}
+		}
+		assert(page_free_area.pf_npage < nfree);
+
+		// no two blocks may overlap
+		for (int i = 0; i < 64; i++) {
+			for (int j = 0; j < (1 << ord[i]); j++) {
+				assert(*(u_int *)page2kva(blk[i] + j) == i);
+			}
+		}
+
+		// free them in a scrambled order
+		for (int j = 0; j < 64; j++) {
+			int i = (j * 37 + round) % 64;
+			page_free_pages(blk[i], ord[i]);
+		}
+
+		// every buddy should have been merged back
+		assert(page_free_area.pf_npage == nfree);
+		for (int k = 0; k <= PAGE_MAX_ORDER; k++) {
+			assert(free_block_count(k) == nblock[k]);
+		}
+	}
+
+	// single pages come back in LIFO order
+	struct Page *pp0, *pp1;
+	assert(page_alloc(&pp0) == 0);
+	assert(page_alloc(&pp1) == 0);
+	page_free(pp1);
+	assert(page_alloc(&pp) == 0 && pp == pp1);
+	page_free(pp);
+	page_free(pp0);
+	assert(page_free_area.pf_npage == nfree);
+
+	// the pre-zeroed pool serves page_alloc, but not page_alloc_nozero
+	page_zero_refill(PAGE_ZERO_REFILL_BATCH);
+	assert(page_free_area.pf_nzero == PAGE_ZERO_REFILL_BATCH);
+	assert(page_alloc_nozero(&pp0) == 0 && !(pp0->pp_flags & PP_ZERO));
+	assert(page_free_area.pf_nzero == PAGE_ZERO_REFILL_BATCH);
+	assert(page_alloc(&pp1) == 0 && !(pp1->pp_flags & PP_ZERO));
+	assert(page_free_area.pf_nzero == PAGE_ZERO_REFILL_BATCH - 1);
+	for (int i = 0; i < PAGE_SIZE / sizeof(u_int); i++) {
+		assert(((u_int *)page2kva(pp1))[i] == 0);
+	}
+	page_free(pp1);
+	page_free(pp0);
+
+	// stealing the free memory takes the pool too, and restoring merges it back
+	struct Page_free_area fl;
+	page_free_area_steal(&fl);
+	assert(page_alloc(&pp) == -E_NO_MEM);
+	page_free_area_restore(&fl);
+	assert(page_free_area.pf_nzero == 0 && page_free_area.pf_npage == nfree);
+
+	printk("buddy_check() succeeded!\n");
+}
+
+void superpage_check(void) {
+	struct Page *pp, *pd;
+	Pte *pte;
+	u_long va = 2 * HUGE_PAIR_SIZE;
+	u_long nfree = page_free_area.pf_npage + page_free_area.pf_nzero;
+
+	assert(page_alloc(&pd) == 0);
+	pd->pp_ref++;
+	Pde *pgdir = (Pde *)page2kva(pd);
+	assert(page_alloc_pages(&pp, HUGE_PAIR_ORDER) == 0);
+
+	// a range with a hole can't be promoted
+	for (int i = 0; i < HUGE_PAIR_NPTE - 1; i++) {
+		assert(page_insert(pgdir, 0, pp + i, va + i * PAGE_SIZE, PTE_D) == 0);
+	}
+	assert(page_promote(pgdir, 0, va) == -E_INVAL);
+	assert(page_insert(pgdir, 0, pp + HUGE_PAIR_NPTE - 1, va + (HUGE_PAIR_NPTE - 1) * PAGE_SIZE,
+			   PTE_D) == 0);
+	// nor can a misaligned one
+	assert(page_promote(pgdir, 0, va + PAGE_SIZE) == -E_INVAL);
+
+	assert(page_promote(pgdir, 0, va) == 0);
+	for (int i = 0; i < HUGE_PAIR_NPTE; i++) {
+		assert(page_lookup(pgdir, va + i * PAGE_SIZE, &pte) == pp + i);
+		assert(*pte & PTE_HUGE);
+	}
+
+	// changing the permission of one page splits the superpage, and PTE_HUGE can't be forced
+	assert(page_insert(pgdir, 0, pp + 3, va + 3 * PAGE_SIZE, PTE_HUGE) == 0);
+	for (int i = 0; i < HUGE_PAIR_NPTE; i++) {
+		assert(page_lookup(pgdir, va + i * PAGE_SIZE, &pte) == pp + i);
+		assert(!(*pte & PTE_HUGE));
+	}
+	assert(page_promote(pgdir, 0, va) == -E_INVAL);
+	assert(page_insert(pgdir, 0, pp + 3, va + 3 * PAGE_SIZE, PTE_D) == 0);
+	assert(page_promote(pgdir, 0, va) == 0);
+
+	// so does unmapping one
+	page_remove(pgdir, 0, va + 17 * PAGE_SIZE);
+	assert(page_lookup(pgdir, va, &pte) == pp && !(*pte & PTE_HUGE));
+	assert(page_promote(pgdir, 0, va) == -E_INVAL);
+
+	for (int i = 0; i < HUGE_PAIR_NPTE; i++) {
+		page_remove(pgdir, 0, va + i * PAGE_SIZE);
+	}
+	page_decref(pa2page(pgdir[PDX(va)]));
+	page_decref(pd);
+	assert(page_free_area.pf_npage + page_free_area.pf_nzero == nfree);
+
+	printk("superpage_check() succeeded!\n");
+}
+
+/* Overview:
+ *   Count the reverse mappings of 'pp'.
+ */
+static int rmap_count(struct Page *pp) {
+	struct Rmap *rm;
+	int n = 0;
+
+	LIST_FOREACH (rm, &pp->pp_rmap, rm_link) {
+		n++;
+	}
+	return n;
+}
+
+void rmap_check(void) {
+	struct Page *pd[3], *pp, *pp1;
+	Pde *pgdir[3];
+	u_long nfree;
+
+	zero_page_get();
+	nfree = page_free_area.pf_npage + page_free_area.pf_nzero;
+	for (int i = 0; i < 3; i++) {
+		assert(page_alloc(&pd[i]) == 0);
+		pd[i]->pp_ref++;
+		pgdir[i] = (Pde *)page2kva(pd[i]);
+	}
+	assert(page_alloc(&pp) == 0);
+	assert(page_alloc(&pp1) == 0);
+
+	// every mapping is recorded once
+	assert(page_insert(pgdir[0], 0, pp, 0, PTE_D) == 0);
+	assert(page_insert(pgdir[0], 0, pp, 2 * PAGE_SIZE, 0) == 0);
+	assert(page_insert(pgdir[1], 0, pp, PAGE_SIZE, PTE_D) == 0);
+	assert(page_insert(pgdir[2], 0, pp, PDMAP, 0) == 0);
+	assert(pp->pp_ref == 4 && rmap_count(pp) == 4);
+	assert(page_insert(pgdir[0], 0, pp, 0, 0) == 0);
+	assert(pp->pp_ref == 4 && rmap_count(pp) == 4);
+
+	// and forgotten when it goes away
+	page_remove(pgdir[0], 0, 2 * PAGE_SIZE);
+	assert(page_insert(pgdir[1], 0, pp1, PAGE_SIZE, PTE_D) == 0);
+	assert(pp->pp_ref == 2 && rmap_count(pp) == 2);
+	assert(pp1->pp_ref == 1 && rmap_count(pp1) == 1);
+
+	// the zero page is never recorded
+	assert(page_insert(pgdir[2], 0, zero_page, 0, 0) == 0);
+	assert(LIST_EMPTY(&zero_page->pp_rmap));
+
+	// unmapping everywhere leaves references that aren't mappings alone
+	pp->pp_ref++;
+	assert(page_unmap_all(pp) == 2);
+	assert(pp->pp_ref == 1 && LIST_EMPTY(&pp->pp_rmap));
+	assert(va2pa(pgdir[0], 0) == ~0 && va2pa(pgdir[2], PDMAP) == ~0);
+	assert(va2pa(pgdir[1], PAGE_SIZE) == page2pa(pp1));
+	assert(page_unmap_all(pp) == 0);
+	page_decref(pp);
+
+	assert(page_unmap_all(pp1) == 1);
+	page_remove(pgdir[2], 0, 0);
+	for (int i = 0; i < 3; i++) {
+		for (u_int pdeno = 0; pdeno <= PDX(PDMAP); pdeno++) {
+			if (pgdir[i][pdeno] & PTE_V) {
+				page_decref(pa2page(pgdir[i][pdeno]));
+			}
+		}
+		page_decref(pd[i]);
+	}
+	assert(page_free_area.pf_npage + page_free_area.pf_nzero == nfree);
+
+	// the pool grows when it runs out, instead of failing while there's memory left
+	struct Rmap_list spare;
+	struct Rmap *rm;
+	LIST_INIT(&spare);
+	while ((rm = LIST_FIRST(&rmap_free_list)) != NULL) {
+		LIST_REMOVE(rm, rm_link);
+		LIST_INSERT_HEAD(&spare, rm, rm_link);
+	}
+	assert(page_alloc(&pd[0]) == 0);
+	pd[0]->pp_ref++;
+	pgdir[0] = (Pde *)page2kva(pd[0]);
+	assert(page_alloc(&pp) == 0);
+	assert(page_insert(pgdir[0], 0, pp, 0, PTE_D) == 0);
+	assert(pp->pp_ref == 1 && rmap_count(pp) == 1 && !LIST_EMPTY(&rmap_free_list));
+	page_remove(pgdir[0], 0, 0);
+	page_decref(pa2page(pgdir[0][0]));
+	page_decref(pd[0]);
+	while ((rm = LIST_FIRST(&spare)) != NULL) {
+		LIST_REMOVE(rm, rm_link);
+		LIST_INSERT_HEAD(&rmap_free_list, rm, rm_link);
+	}
+
+	printk("rmap_check() succeeded!\n");
+}
+
+void pgtable_check(void) {
+	struct Page *pd, *pp, *pt;
+	struct Mem_stat st;
+	u_long nfree = page_free_area.pf_npage + page_free_area.pf_nzero;
+	u_long npt = pgtable_npage;
+
+	assert(page_alloc(&pd) == 0);
+	pd->pp_ref++;
+	Pde *pgdir = (Pde *)page2kva(pd);
+	assert(page_alloc(&pp) == 0);
+	pp->pp_ref++;
+
+	// entries in use are counted as they come and go
+	assert(page_insert(pgdir, 0, pp, 0, 0) == 0);
+	pt = pa2page(pgdir[0]);
+	assert(pt->pp_npte == 1);
+	assert(page_insert(pgdir, 0, pp, PAGE_SIZE, 0) == 0);
+	assert(page_insert(pgdir, 0, pp, PAGE_SIZE, PTE_D) == 0);
+	assert(pt->pp_npte == 2);
+	page_remove(pgdir, 0, 0);
+	page_remove(pgdir, 0, 0);
+	assert(pt->pp_npte == 1);
+
+	// 'page_unmap' frees a page table with its last entry, 'page_remove' doesn't
+	page_unmap(pgdir, 0, 2 * PAGE_SIZE);
+	assert(pgdir[0] & PTE_V);
+	page_unmap(pgdir, 0, PAGE_SIZE);
+	assert(pgdir[0] == 0);
+	assert(page_insert(pgdir, 0, pp, 0, 0) == 0);
+	page_remove(pgdir, 0, 0);
+	assert((pgdir[0] & PTE_V) && pa2page(pgdir[0])->pp_npte == 0);
+	page_unmap(pgdir, 0, 0);
+	assert(pgdir[0] == 0);
+
+	// so does 'page_unmap_all'
+	assert(page_insert(pgdir, 0, pp, PDMAP, 0) == 0);
+	assert(page_insert(pgdir, 0, pp, PDMAP + PAGE_SIZE, 0) == 0);
+	assert(page_insert(pgdir, 0, pp, 2 * PDMAP, 0) == 0);
+	assert(pgtable_npage == npt + 2);
+
+	// 'mem_stat' counts the entries in the range and the page tables covering it
+	mem_stat(pgdir, 0, UTOP, &st);
+	assert(st.ms_nresident == 3 && st.ms_nshared == 3 && st.ms_ncow == 0);
+	assert(st.ms_nenvpgtable == 3 && st.ms_npgtable == pgtable_npage);
+	mem_stat(pgdir, PDMAP + PAGE_SIZE, PDMAP, &st);
+	assert(st.ms_nresident == 2 && st.ms_nenvpgtable == 3);
+	mem_stat(pgdir, 0, PDMAP, &st);
+	assert(st.ms_nresident == 0 && st.ms_nenvpgtable == 1);
+	assert(st.ms_nfree == page_free_area.pf_npage + page_free_area.pf_nzero + highmem_nfree);
+
+	assert(page_unmap_all(pp) == 3);
+	assert(pgdir[1] == 0 && pgdir[2] == 0);
+	assert(pp->pp_ref == 1);
+	assert(pgtable_npage == npt);
+
+	// the counts 'mem_stat' reads follow the mappings as they come and go, see 'pte_set'
+	assert(page_insert(pgdir, 0, pp, 0, PTE_COW) == 0);
+	assert(page_insert(pgdir, 0, pp, PDMAP, 0) == 0);
+	pt = pa2page(pgdir[0]);
+	assert(pp->pp_npte == 2 && pt->pp_nshared == 1 && pt->pp_ncow == 1);
+	assert(pa2page(pgdir[1])->pp_nshared == 1 && pa2page(pgdir[1])->pp_ncow == 0);
+	page_remove(pgdir, 0, PDMAP);
+	assert(pp->pp_npte == 1 && pt->pp_nshared == 0 && pt->pp_ncow == 1);
+	assert(page_insert(pgdir, 0, pp, 0, 0) == 0);
+	assert(pt->pp_ncow == 0 && pt->pp_npte == 1);
+	mem_stat(pgdir, 0, UTOP, &st);
+	assert(st.ms_nresident == 1 && st.ms_nshared == 0 && st.ms_ncow == 0);
+	page_unmap(pgdir, 0, 0);
+	page_unmap(pgdir, 0, PDMAP);
+	assert(pgdir[0] == 0 && pgdir[1] == 0 && pp->pp_npte == 0);
+	assert(pgtable_npage == npt);
+
+	page_decref(pp);
+	page_decref(pd);
+	assert(page_free_area.pf_npage + page_free_area.pf_nzero == nfree);
+
+	printk("pgtable_check() succeeded!\n");
+}
+
+void highmem_check(void) {
+	struct Page *pp[KMAP_NSLOT];
+	u_int *va[KMAP_NSLOT];
+	u_long nhigh = highmem_nfree;
+	u_int *p;
+
+	// user pages come from highmem while there's some, and are reached through 'kmap'
+	for (int i = 0; i < KMAP_NSLOT; i++) {
+		assert(page_alloc_user(&pp[i]) == 0);
+		pp[i]->pp_ref = 1;
+		assert(page_is_highmem(pp[i]) == (nhigh > i));
+		assert(pa2page(page2pa(pp[i])) == pp[i]);
+		va[i] = kmap(pp[i]);
+		assert(((u_long)va[i] >= KMAP_BASE) == page_is_highmem(pp[i]));
+		for (int j = 0; j < PAGE_SIZE / sizeof(u_int); j++) {
+			assert(va[i][j] == 0);
+		}
+		va[i][0] = i;
+	}
+	for (int i = KMAP_NSLOT - 1; i >= 0; i--) {
+		kunmap(va[i]);
+	}
+
+	// a slot is free again once unmapped, and maps whatever page is asked for
+	for (int i = 0; i < KMAP_NSLOT; i++) {
+		p = kmap(pp[i]);
+		assert(p[0] == i);
+		kunmap(p);
+		page_decref(pp[i]);
+	}
+	assert(highmem_nfree == nhigh);
+
+	// with no highmem left, user pages are still zeroed, whatever they held when freed
+	if (nhigh == 0) {
+		struct Page_free_area fl;
+
+		assert(page_alloc(&pp[0]) == 0);
+		memset((void *)page2kva(pp[0]), 0xa5, PAGE_SIZE);
+		page_free_area_steal(&fl);
+		page_free(pp[0]);
+		assert(page_alloc_user(&pp[1]) == 0 && pp[1] == pp[0]);
+		p = (u_int *)page2kva(pp[1]);
+		for (int j = 0; j < PAGE_SIZE / sizeof(u_int); j++) {
+			assert(p[j] == 0);
+		}
+		page_free(pp[1]);
+		page_free_area_restore(&fl);
+	}
+
+	printk("highmem_check() succeeded!\n");
+}
+
 void page_check(void) {
 	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page_list fl;
+	struct Page_free_area fl;
 
 	// should be able to allocate a page for directory
 	assert(page_alloc(&pp) == 0);
@@ -425,9 +1579,8 @@ void page_check(void) {
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	// now this page_free list must be empty!!!!
-	LIST_INIT(&page_free_list);
+	page_free_area_steal(&fl);
+	// now the free lists must be empty!!!!
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -511,7 +1664,7 @@ void page_check(void) {
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	page_free_area_restore(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1,53 +1,393 @@
+#include <bitops.h>
 #include <env.h>
+#include <ksm.h>
 #include <pmap.h>
 #include <printk.h>
+#include <sched.h>
+
+/* The runnable envs of the priority class, in one queue per priority level. An env with
+ * priority 'sched_pri' is on the queue of level MIN(sched_pri, ENV_NPRI - 1). */
+struct Sched_array {
+	u_int sa_bitmap; // bit i is set iff. 'sa_queue[i]' isn't empty
+	struct Env_sched_list sa_queue[ENV_NPRI];
+};
+
+/* Each round, the envs on the active array run for 'sched_pri' ticks each, the highest level
+ * first. An env whose time is up waits on the expired array for the next round, which starts
+ * when the active array runs out, by swapping the two. The ticks an env has left are kept in
+ * 'env_slice' while it's off the CPU, asleep too, so that an env that keeps blocking early
+ * still runs out of time and lets the expired array have its round. */
+static struct Sched_array sched_arrays[2];
+static struct Sched_array *sched_active = &sched_arrays[0];
+static struct Sched_array *sched_expired = &sched_arrays[1];
+
+/* The runnable envs of the fair class, in a binary min-heap on 'env_vruntime' (from index 1,
+ * the children of 'i' being '2 * i' and '2 * i + 1'). */
+static struct Env *sched_fair_heap[NENV + 1];
+static u_int sched_fair_n;
+static uint64_t sched_min_vruntime; // never goes back, the least 'env_vruntime' seen at a tick
+
+static int sched_count; // remaining ticks of the running env, in the priority class
+
+/* Overview:
+ *   Return the priority 'e' is scheduled at: its 'env_pri', or that of the highest env waiting
+ *   for it to serve a request if that's higher, so that the env can't be kept waiting by envs
+ *   of priorities between the two.
+ */
+u_int sched_pri(struct Env *e) {
+	return MAX(e->env_pri, e->env_inh_pri);
+}
+
+static u_int sched_level(struct Env *e) {
+	return MIN(sched_pri(e), ENV_NPRI - 1);
+}
+
+/* Overview:
+ *   Make all the run queues empty.
+ */
+void sched_init(void) {
+	for (int i = 0; i < 2; i++) {
+		sched_arrays[i].sa_bitmap = 0;
+		for (int j = 0; j < ENV_NPRI; j++) {
+			TAILQ_INIT(&sched_arrays[i].sa_queue[j]);
+		}
+	}
+	sched_fair_n = 0;
+}
+
+static void sched_enqueue(struct Sched_array *sa, struct Env *e) {
+	u_int level = sched_level(e);
+
+	TAILQ_INSERT_TAIL(&sa->sa_queue[level], e, env_sched_link);
+	sa->sa_bitmap |= 1U << level;
+	e->env_runq = sa;
+}
+
+static void fair_set(u_int i, struct Env *e) {
+	sched_fair_heap[i] = e;
+	e->env_fair_idx = i;
+}
+
+/* Overview:
+ *   Move the env at index 'i' of the heap up or down to where its 'env_vruntime' belongs.
+ */
+static void fair_fix(u_int i) {
+	struct Env *e = sched_fair_heap[i];
+	u_int child;
+
+	while (i > 1 && e->env_vruntime < sched_fair_heap[i / 2]->env_vruntime) {
+		fair_set(i, sched_fair_heap[i / 2]);
+		i /= 2;
+	}
+	while ((child = 2 * i) <= sched_fair_n) {
+		if (child < sched_fair_n &&
+		    sched_fair_heap[child + 1]->env_vruntime < sched_fair_heap[child]->env_vruntime) {
+			child++;
+		}
+		if (e->env_vruntime <= sched_fair_heap[child]->env_vruntime) {
+			break;
+		}
+		fair_set(i, sched_fair_heap[child]);
+		i = child;
+	}
+	fair_set(i, e);
+}
 
 /* Overview:
- *   Implement a round-robin scheduling to select a runnable env and schedule it using 'env_run'.
+ *   Put the runnable env 'e' on the run queues of its class. In the priority class, it goes
+ *   to the tail of its queue, to run in the current round if it has ticks left in it, or else
+ *   in the next one with a new slice. In the fair class, a new env starts level with the
+ *   others, and one that slept gets at most 'SCHED_WAKEUP_CREDIT' of credit, so that sleeping
+ *   can't be saved up to starve the others later.
+ *
+ * Pre-Condition:
+ *   'e' isn't on any queue. Its 'sched_pri' and 'env_sched_class' aren't changed until it's
+ *   taken off with 'sched_remove'.
+ */
+void sched_insert(struct Env *e) {
+	assert(e->env_runq == NULL && e->env_fair_idx == 0);
+	if (e->env_sched_class == ENV_SCHED_PRIO) {
+		if (e->env_runs == 0) {
+			e->env_slice = sched_pri(e);
+		}
+		if (e->env_slice > 0) {
+			sched_enqueue(sched_active, e);
+		} else {
+			e->env_slice = sched_pri(e);
+			sched_enqueue(sched_expired, e);
+		}
+		return;
+	}
+	if (e->env_runs == 0) {
+		e->env_vruntime = sched_min_vruntime;
+	} else if (e->env_vruntime + SCHED_WAKEUP_CREDIT < sched_min_vruntime) {
+		e->env_vruntime = sched_min_vruntime - SCHED_WAKEUP_CREDIT;
+	}
+	sched_fair_n++;
+	fair_set(sched_fair_n, e);
+	fair_fix(sched_fair_n);
+}
+
+/* Overview:
+ *   Take 'e' off its queue. Does nothing if it's on none.
+ */
+void sched_remove(struct Env *e) {
+	struct Sched_array *sa = e->env_runq;
+	u_int level = sched_level(e);
+	u_int i = e->env_fair_idx;
+
+	if (sa != NULL) {
+		TAILQ_REMOVE(&sa->sa_queue[level], e, env_sched_link);
+		if (TAILQ_EMPTY(&sa->sa_queue[level])) {
+			sa->sa_bitmap &= ~(1U << level);
+		}
+		e->env_runq = NULL;
+	} else if (i != 0) {
+		e->env_fair_idx = 0;
+		if (i != sched_fair_n) {
+			fair_set(i, sched_fair_heap[sched_fair_n]);
+			sched_fair_n--;
+			fair_fix(i);
+		} else {
+			sched_fair_n--;
+		}
+	}
+}
+
+/* Overview:
+ *   Set the priority and inherited priority of 'e', moving it in the run queues if it's on them.
+ *   In the priority class, it stays on the same array, so that an expired env doesn't get to
+ *   run in the current round again.
+ */
+static void sched_set(struct Env *e, u_int pri, u_int inh_pri) {
+	struct Sched_array *sa = e->env_runq;
+	int queued = e->env_status == ENV_RUNNABLE;
+
+	if (queued) {
+		sched_remove(e);
+	}
+	e->env_pri = pri;
+	e->env_inh_pri = inh_pri;
+	if (sa != NULL) {
+		sched_enqueue(sa, e);
+	} else if (queued) {
+		sched_insert(e);
+	}
+}
+
+/* Overview:
+ *   Work out again the priority 'e' inherits from the envs waiting for it, then that of the
+ *   env it waits for in turn, and so on down the chain as long as something changes. The
+ *   chain is followed for at most 'NENV' envs, in case envs wait for each other in a cycle.
+ */
+static void sched_inherit(struct Env *e) {
+	struct Env *w;
+	u_int inh_pri;
+
+	for (u_int n = 0; e != NULL && n < NENV; n++, e = e->env_waiting) {
+		inh_pri = 0;
+		LIST_FOREACH (w, &e->env_waiters, env_waiter_link) {
+			inh_pri = MAX(inh_pri, sched_pri(w));
+		}
+		if (inh_pri == e->env_inh_pri) {
+			break;
+		}
+		sched_set(e, e->env_pri, inh_pri);
+	}
+}
+
+/* Overview:
+ *   Set the priority 'env_pri' of 'e' to 'pri', and pass the change on to the envs serving it.
+ */
+void sched_set_pri(struct Env *e, u_int pri) {
+	sched_set(e, pri, e->env_inh_pri);
+	sched_inherit(e->env_waiting);
+}
+
+/* Overview:
+ *   Move 'e' to the scheduling class 'class'. It starts the priority class with a full slice,
+ *   in the current round.
+ */
+void sched_set_class(struct Env *e, u_int class) {
+	int queued = e->env_status == ENV_RUNNABLE;
+
+	if (queued) {
+		sched_remove(e);
+	}
+	e->env_sched_class = class;
+	e->env_slice = sched_pri(e);
+	if (queued) {
+		sched_insert(e);
+	}
+}
+
+/* Overview:
+ *   Note that 'e' waits for 'server' to serve its request (or for no env if 'server' is NULL),
+ *   so that 'server' runs at no lower a priority than 'e' meanwhile, see 'sched_pri'.
+ */
+void sched_wait(struct Env *e, struct Env *server) {
+	struct Env *old = e->env_waiting;
+
+	if (old == server) {
+		return;
+	}
+	if (old != NULL) {
+		LIST_REMOVE(e, env_waiter_link);
+		e->env_waiting = NULL;
+		sched_inherit(old);
+	}
+	if (server != NULL) {
+		LIST_INSERT_HEAD(&server->env_waiters, e, env_waiter_link);
+		e->env_waiting = server;
+		sched_inherit(server);
+	}
+}
+
+/* Overview:
+ *   Stop the freed env 'e' from waiting, and the envs waiting for it too.
+ */
+void sched_wait_drop(struct Env *e) {
+	struct Env *w;
+
+	sched_wait(e, NULL);
+	while ((w = LIST_FIRST(&e->env_waiters)) != NULL) {
+		LIST_REMOVE(w, env_waiter_link);
+		w->env_waiting = NULL;
+	}
+	sched_set(e, e->env_pri, 0);
+}
+
+/* Overview:
+ *   Return the value of CP0 Count. It's cleared by 'env_pop_tf' each time an env is run, so
+ *   it tells the cycles since 'curenv' was run, the time it spent in the kernel included.
+ */
+static u_int sched_clock(void) {
+	u_int count;
+
+	asm volatile("mfc0 %0, $9" : "=r"(count) :);
+	return count;
+}
+
+/* Overview:
+ *   Charge 'e', the env that was running, with the cycles it used since it was run. Every
+ *   way out of an env to another goes through 'schedule', so an env that blocks or yields
+ *   early is charged for what it used only, and one that trapped in is charged for the time
+ *   it kept the kernel busy.
+ */
+static void sched_charge(struct Env *e) {
+	u_int delta = sched_clock();
+
+	e->env_runtime += delta;
+	if (e->env_sched_class == ENV_SCHED_FAIR) {
+		e->env_vruntime += delta / MAX(sched_pri(e), 1U);
+		if (e->env_fair_idx != 0) {
+			fair_fix(e->env_fair_idx);
+		}
+	}
+	if (sched_fair_n > 0 && sched_fair_heap[1]->env_vruntime > sched_min_vruntime) {
+		sched_min_vruntime = sched_fair_heap[1]->env_vruntime;
+	}
+}
+
+/* Overview:
+ *   Return the env to run next: the first env of the highest non-empty level of the active
+ *   array of the priority class (starting a new round first if it's empty), or else the env
+ *   with the least 'env_vruntime' of the fair class, passing over 'curenv' if 'yield' is set
+ *   and it's not alone. Panic if there's no runnable env.
+ */
+static struct Env *sched_pick(int yield) {
+	struct Sched_array *sa;
+	u_int i;
+
+	if (sched_active->sa_bitmap == 0) {
+		sa = sched_active;
+		sched_active = sched_expired;
+		sched_expired = sa;
+	}
+	if (sched_active->sa_bitmap != 0) {
+		return TAILQ_FIRST(&sched_active->sa_queue[fls(sched_active->sa_bitmap) - 1]);
+	}
+	if (sched_fair_n == 0) {
+		panic("schedule: no runnable envs");
+	}
+	i = 1;
+	if (yield && sched_fair_heap[1] == curenv && sched_fair_n >= 2) {
+		i = 2;
+		if (sched_fair_n >= 3 &&
+		    sched_fair_heap[3]->env_vruntime < sched_fair_heap[2]->env_vruntime) {
+			i = 3;
+		}
+	}
+	return sched_fair_heap[i];
+}
+
+/* Overview:
+ *   Tell whether 'e', the runnable env that was running, goes on running with 'count' ticks
+ *   left. An env of the priority class does until its ticks are up or a higher level gets
+ *   runnable. One of the fair class is picked again only if it's still the one behind.
+ */
+static int sched_keep(struct Env *e, int count) {
+	if (e->env_sched_class == ENV_SCHED_FAIR) {
+		return 0;
+	}
+	return count > 0 && fls(sched_active->sa_bitmap) <= sched_level(e) + 1;
+}
+
+/* Overview:
+ *   Charge the running env, then select a runnable env and run it with 'env_run'. The envs of
+ *   the priority class go first, as their O(1) run queues say, then those of the fair class,
+ *   the one that had the least CPU time for its 'sched_pri' first.
  *
  * Post-Condition:
  *   If 'yield' is set (non-zero), 'curenv' should not be scheduled again unless it is the only
  *   runnable env.
  *
  * Hints:
- *   1. The variable 'count' used for counting slices should be defined as 'static'.
- *   2. Use variable 'env_sched_list', which contains and only contains all runnable envs.
+ *   1. The ticks left are counted in 'sched_count', which 'sched_handoff' passes on too. In the
+ *      priority class, they're saved in 'env_slice' of the env leaving the CPU, and taken from
+ *      that of the env picked, see 'sched_insert'.
+ *   2. A runnable env is on the run queues of its class, see 'sched_insert'.
  *   3. You shouldn't use any 'return' statement because this function is 'noreturn'.
  */
 void schedule(int yield) {
-	static int count = 0; // remaining time slices of current env
 	struct Env *e = curenv;
 
-	/* We always decrease the 'count' by 1.
-	 *
-	 * If 'yield' is set, or 'count' has been decreased to 0, or 'e' (previous 'curenv') is
-	 * 'NULL', or 'e' is not runnable, then we pick up a new env from 'env_sched_list' (list of
-	 * all runnable envs), set 'count' to its priority, and schedule it with 'env_run'. **Panic
-	 * if that list is empty**.
-	 *
-	 * (Note that if 'e' is still a runnable env, we should move it to the tail of
-	 * 'env_sched_list' before picking up another env from its head, or we will schedule the
-	 * head env repeatedly.)
-	 *
-	 * Otherwise, we simply schedule 'e' again.
-	 *
-	 * You may want to use macros below:
-	 *   'TAILQ_FIRST', 'TAILQ_REMOVE', 'TAILQ_INSERT_TAIL'
-	 */
-	/* Exercise 3.12: Your code here. */
-	if (yield || count <= 0 || e == NULL || e->env_status != ENV_RUNNABLE) {
-		if (e != NULL) {
-			TAILQ_REMOVE(&env_sched_list, e, env_sched_link);
-			if (e->env_status == ENV_RUNNABLE) {
-				TAILQ_INSERT_TAIL(&env_sched_list, e, env_sched_link);
-			}
-		}
-		if (TAILQ_EMPTY(&env_sched_list)) {
-			panic("schedule: no runnable envs");
-		}
-		e = TAILQ_FIRST(&env_sched_list);
-		count = e->env_pri;
-	}
-	count--;
+	if (e != NULL) {
+		sched_charge(e);
+		e->env_slice = sched_count;
+	}
+	if (yield || e == NULL || e->env_status != ENV_RUNNABLE || !sched_keep(e, sched_count)) {
+		if (e != NULL && e->env_status == ENV_RUNNABLE &&
+		    e->env_sched_class == ENV_SCHED_PRIO && (yield || sched_count <= 0)) {
+			// its time is up for this round (a preempted env stays where it is)
+			sched_remove(e);
+			e->env_slice = sched_pri(e);
+			sched_enqueue(sched_expired, e);
+		}
+		e = sched_pick(yield);
+		if (yield && e == curenv) {
+			// the env giving up the CPU is the only runnable one, i.e. the system is idle
+			page_zero_refill(PAGE_ZERO_REFILL_BATCH);
+			ksm_idle();
+		}
+		sched_count = e->env_sched_class == ENV_SCHED_PRIO ? e->env_slice : sched_pri(e);
+	}
+	sched_count--;
+	env_run(e);
+}
+
+/* Overview:
+ *   Charge the running env and switch straight to the runnable env 'e', which runs for the
+ *   rest of the time slice of 'curenv' instead of waiting for its turn on the run queues.
+ *   This is how an IPC message wakes up the env it's for, see 'sys_ipc_call'.
+ *
+ * Pre-Condition:
+ *   'e' is runnable, and so is 'curenv' if it's to run again (it keeps its place in the run
+ *   queues).
+ */
+void sched_handoff(struct Env *e) {
+	assert(e->env_status == ENV_RUNNABLE);
+	sched_charge(curenv);
+	curenv->env_slice = sched_count;
 	env_run(e);
 }
@@ -0,0 +1,305 @@
+#include <env.h>
+#include <io.h>
+#include <malta.h>
+#include <pmap.h>
+#include <printk.h>
+#include <sched.h>
+#include <swap.h>
+
+extern struct Env envs[];
+
+// Software bits of a PTE. Only pages whose software bits are all owned by the kernel's COW
+// handling may be swapped out: 'PTE_LIBRARY' pages are shared, superpages are mapped as a
+// whole, and other bits belong to user space (e.g. the file system server's dirty bit).
+#define PTE_SOFT_FLAGS ((1 << PTE_HARDFLAG_SHIFT) - 1)
+
+// The number of PTEs holding each swap slot, 0 if the slot is free.
+static u_short swap_slot_ref[SWAP_NSLOT];
+static u_int swap_slot_hint;
+
+// 0 until the swap disk is probed, then 1 if it's there or -1 if it's not.
+static int swap_disk;
+
+// The clock hand: the page at 'swap_hand_va' in 'envs[swap_hand_env]'.
+static u_int swap_hand_env;
+static u_long swap_hand_va = UTEMP;
+
+u_long swap_nout; // pages swapped out so far
+u_long swap_nin;  // pages swapped in so far
+
+/* Overview:
+ *   Wait for the IDE channel to leave the busy state and return its status.
+ */
+static u_char ide_wait(void) {
+	u_char status;
+
+	while ((status = ioread8(MALTA_IDE_STATUS)) & MALTA_IDE_BUSY) {
+	}
+	return status;
+}
+
+/* Overview:
+ *   Tell whether the IDE channel can take a command now, that is, whether it's neither busy
+ *   nor in the middle of a data transfer the file system server started from user space.
+ */
+static int ide_idle(void) {
+	return !(ioread8(MALTA_IDE_STATUS) & (MALTA_IDE_BUSY | MALTA_IDE_DRQ));
+}
+
+/* Overview:
+ *   Read ('write' is 0) or write 'nsecs' sectors at 'secno' of the swap disk from/to 'buf',
+ *   one sector at a time with PIO, the way 'ide_read' and 'ide_write' of the file system
+ *   server do from user space.
+ *
+ * Pre-Condition:
+ *   'ide_idle()' holds.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_UNSPECIFIED if the disk reports an error.
+ *   The task file registers are restored afterwards, so that a request the file system server
+ *   was setting up when it got interrupted goes on unaffected.
+ */
+static int ide_rw(u_int secno, void *buf, u_int nsecs, int write) {
+	static const u_long taskfile[] = {MALTA_IDE_DEVICE, MALTA_IDE_NSECT, MALTA_IDE_LBAL,
+					  MALTA_IDE_LBAM, MALTA_IDE_LBAH};
+	u_char saved[sizeof(taskfile) / sizeof(taskfile[0])];
+	u_int *p = buf;
+	int r = 0;
+
+	for (int i = 0; i < sizeof(saved); i++) {
+		saved[i] = ioread8(taskfile[i]);
+	}
+
+	for (; nsecs > 0 && r == 0; nsecs--, secno++) {
+		iowrite8(((secno >> 24) & 0x0f) | MALTA_IDE_LBA | (SWAP_DISKNO << 4), MALTA_IDE_DEVICE);
+		iowrite8(1, MALTA_IDE_NSECT);
+		iowrite8(secno & 0xff, MALTA_IDE_LBAL);
+		iowrite8((secno >> 8) & 0xff, MALTA_IDE_LBAM);
+		iowrite8((secno >> 16) & 0xff, MALTA_IDE_LBAH);
+		iowrite8(write ? MALTA_IDE_CMD_PIO_WRITE : MALTA_IDE_CMD_PIO_READ, MALTA_IDE_STATUS);
+		ide_wait();
+		for (int i = 0; i < SWAP_SECT_SIZE / 4; i++, p++) {
+			if (write) {
+				iowrite32(*p, MALTA_IDE_DATA);
+			} else {
+				*p = ioread32(MALTA_IDE_DATA);
+			}
+		}
+		if (ide_wait() & MALTA_IDE_ERROR) {
+			r = -E_UNSPECIFIED;
+		}
+	}
+
+	for (int i = 0; i < sizeof(saved); i++) {
+		iowrite8(saved[i], taskfile[i]);
+	}
+	return r;
+}
+
+/* Overview:
+ *   Tell whether the swap disk is attached, probing it on first use.
+ */
+static int swap_disk_present(void) {
+	u_char device, status;
+
+	if (swap_disk == 0) {
+		device = ioread8(MALTA_IDE_DEVICE);
+		iowrite8(MALTA_IDE_LBA | (SWAP_DISKNO << 4), MALTA_IDE_DEVICE);
+		status = ioread8(MALTA_IDE_STATUS);
+		iowrite8(device, MALTA_IDE_DEVICE);
+		// an empty position reads as all zeros (or all ones with no disk on the channel)
+		swap_disk = (status != 0 && status != 0xff) ? 1 : -1;
+		printk("swap: %s\n", swap_disk > 0 ? "enabled on ide1" : "no disk on ide1");
+	}
+	return swap_disk > 0;
+}
+
+/* Overview:
+ *   Give up the CPU because the IDE channel is busy, and have the access that needs swapping
+ *   done again when 'curenv' runs next.
+ *
+ * Hint:
+ *   A faulting instruction is simply executed again, but a syscall has already moved its EPC
+ *   past the 'syscall' instruction, so it's moved back to restart the syscall. That's safe as
+ *   long as the syscall has done nothing yet, see 'user_fault_in'.
+ */
+static void __attribute__((noreturn)) swap_retry_later(void) {
+	struct Trapframe *tf = (struct Trapframe *)KSTACKTOP - 1;
+
+	if (((tf->cp0_cause >> 2) & 0x1f) == 8) {
+		tf->cp0_epc -= 4;
+	}
+	schedule(1);
+}
+
+/* Overview:
+ *   Return the PTE of 'va' in 'pgdir', or NULL if it has no page table.
+ */
+static Pte *swap_pte(Pde *pgdir, u_long va) {
+	if (!(pgdir[PDX(va)] & PTE_V)) {
+		return NULL;
+	}
+	return (Pte *)KADDR(PTE_ADDR(pgdir[PDX(va)])) + PTX(va);
+}
+
+/* Overview:
+ *   Tell whether the page mapped by 'pte' may be swapped out: it's mapped nowhere else and
+ *   carries no software bit other than 'PTE_COW'. Highmem pages are left alone, as swapping
+ *   is there to win back pages the kernel can use and user pages come from highmem first.
+ */
+static int swap_candidate(Pte pte) {
+	return (pte & PTE_V) && !(pte & PTE_SOFT_FLAGS & ~PTE_COW) && pa2page(pte)->pp_ref == 1 &&
+	       !page_is_highmem(pa2page(pte));
+}
+
+/* Overview:
+ *   Move the clock hand over the user pages of all envs but those driving the disk (see
+ *   'sys_read_dev') until it finds a page to swap out.
+ *   A candidate found in the TLB was used lately: it gets its entry invalidated and a second
+ *   chance, so the TLB serves as the reference bit MIPS lacks.
+ *
+ * Post-Condition:
+ *   Return the PTE of the victim, with its env in '*pe' and its address in '*pva', or NULL
+ *   if there's none after the hand went twice around.
+ */
+static Pte *swap_victim(struct Env **pe, u_long *pva) {
+	struct Env *e;
+	Pte *pte;
+	u_long va;
+
+	for (u_int n = 0; n < 2 * NENV;) {
+		e = &envs[swap_hand_env];
+		while (e->env_status != ENV_FREE && !e->env_disk && swap_hand_va < UTOP) {
+			va = swap_hand_va;
+			if ((pte = swap_pte(e->env_pgdir, va)) == NULL) {
+				swap_hand_va = ROUNDDOWN(va, PDMAP) + PDMAP;
+				continue;
+			}
+			swap_hand_va += PAGE_SIZE;
+			if (swap_candidate(*pte) && !tlb_invalidate_used(e->env_asid, va)) {
+				*pe = e;
+				*pva = va;
+				return pte;
+			}
+		}
+		swap_hand_env = (swap_hand_env + 1) % NENV;
+		swap_hand_va = UTEMP;
+		n++;
+	}
+	return NULL;
+}
+
+/* Overview:
+ *   Take a free swap slot. Return its number, or -1 if the swap area is full.
+ */
+static int swap_slot_alloc(void) {
+	for (u_int i = 0; i < SWAP_NSLOT; i++) {
+		u_int slot = (swap_slot_hint + i) % SWAP_NSLOT;
+		if (swap_slot_ref[slot] == 0) {
+			swap_slot_ref[slot] = 1;
+			swap_slot_hint = slot + 1;
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* Overview:
+ *   Write a cold user page out to the swap disk and free it, leaving a 'PTE_SWAP' entry
+ *   behind. This is how a single page is won back when the allocator runs dry.
+ *
+ * Post-Condition:
+ *   Return 0 if a page was freed.
+ *   Return -E_NO_MEM if there's no swap disk, it's busy, the swap area is full, or no page
+ *   can be swapped out.
+ */
+int swap_out(void) {
+	struct Env *e;
+	struct Page *pp;
+	Pte *pte;
+	u_long va;
+	int slot;
+
+	if (!swap_disk_present() || !ide_idle()) {
+		return -E_NO_MEM;
+	}
+	if ((slot = swap_slot_alloc()) < 0) {
+		return -E_NO_MEM;
+	}
+	if ((pte = swap_victim(&e, &va)) == NULL) {
+		swap_slot_ref[slot] = 0;
+		return -E_NO_MEM;
+	}
+
+	pp = pa2page(*pte);
+	if (ide_rw(slot * SWAP_SECT_PER_PAGE, (void *)page2kva(pp), SWAP_SECT_PER_PAGE, 1) != 0) {
+		swap_slot_ref[slot] = 0;
+		return -E_NO_MEM;
+	}
+	pte_set(pte, ((u_long)slot << PGSHIFT) | (PTE_FLAGS(*pte) & ~PTE_V) | PTE_SWAP);
+	tlb_invalidate(e->env_asid, va);
+	page_rmap_remove(pp, e->env_pgdir, va);
+	page_decref(pp);
+	swap_nout++;
+	return 0;
+}
+
+/* Overview:
+ *   Bring back the page at 'va' in 'pgdir' (with ASID 'asid') if it's swapped out.
+ *
+ * Post-Condition:
+ *   Return 0 if 'va' isn't swapped out, or once its page is mapped again as it was.
+ *   Return -E_NO_MEM if there's no free page to read it into, or no reverse mapping left.
+ *   If the IDE channel is in use by the file system server, yield and retry later instead
+ *   (doesn't return).
+ */
+int swap_in(Pde *pgdir, u_int asid, u_long va) {
+	struct Page *pp;
+	Pte *pte;
+	u_int slot;
+	void *buf;
+	int r;
+
+	if ((pte = swap_pte(pgdir, va)) == NULL || !PTE_IS_SWAP(*pte)) {
+		return 0;
+	}
+	if (!ide_idle()) {
+		swap_retry_later();
+	}
+	try(page_alloc_user_nozero(&pp));
+	if (page_rmap_add(pp, pgdir, va) != 0) {
+		page_free(pp);
+		return -E_NO_MEM;
+	}
+
+	slot = PPN(*pte);
+	buf = kmap(pp);
+	r = ide_rw(slot * SWAP_SECT_PER_PAGE, buf, SWAP_SECT_PER_PAGE, 0);
+	kunmap(buf);
+	if (r != 0) {
+		panic("swap_in: can't read swap slot %d", slot);
+	}
+	pte_set(pte, page2pa(pp) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V);
+	pp->pp_ref = 1;
+	swap_slot_ref[slot]--;
+	// the invalid entry of the pair may still be in the TLB
+	tlb_invalidate(asid, va);
+	swap_nin++;
+	return 0;
+}
+
+/* Overview:
+ *   Note that the swap entry 'pte' was copied into another page table.
+ */
+void swap_dup(Pte pte) {
+	assert(PTE_IS_SWAP(pte) && swap_slot_ref[PPN(pte)] > 0);
+	swap_slot_ref[PPN(pte)]++;
+}
+
+/* Overview:
+ *   Drop the swap entry 'pte', freeing its slot when no other entry holds it.
+ */
+void swap_free(Pte pte) {
+	assert(PTE_IS_SWAP(pte) && swap_slot_ref[PPN(pte)] > 0);
+	swap_slot_ref[PPN(pte)]--;
+}
@@ -1,13 +1,41 @@
+#include <elf.h>
 #include <env.h>
 #include <io.h>
+#include <kmalloc.h>
+#include <ksm.h>
+#include <lazy.h>
 #include <mmu.h>
 #include <pmap.h>
 #include <printk.h>
 #include <sched.h>
+#include <swap.h>
 #include <syscall.h>
 
 extern struct Env *curenv;
 
+/* Overview:
+ *   Fault in the pages of [va, va + len) of 'curenv', for writing if 'write' is set.
+ *
+ * Hint:
+ *   A fault on user memory in a syscall may restart the whole syscall (see 'pgfault_upcall'
+ *   and 'swap_retry_later'), so a syscall with side effects calls this first, before it has
+ *   done anything that mustn't be done twice. The pages then stay in until it returns: the
+ *   kernel isn't preempted, and a page 'swap_out' takes meanwhile is brought back without
+ *   waiting, as the disk was idle for 'swap_out' and nothing else ran since.
+ */
+static void user_fault_in(u_long va, u_int len, int write) {
+	volatile u_char *p;
+
+	for (u_long a = va; a < va + len; a = ROUNDDOWN(a, PAGE_SIZE) + PAGE_SIZE) {
+		p = (volatile u_char *)a;
+		if (write) {
+			*p = *p;
+		} else {
+			(void)*p;
+		}
+	}
+}
+
 /* Overview:
  * 	This function is used to print a character on screen.
  *
@@ -29,6 +57,7 @@ int sys_print_cons(const void *s, u_int num) {
 	if (((u_int)s + num) > UTOP || ((u_int)s) >= UTOP || (s > s + num)) {
 		return -E_INVAL;
 	}
+	user_fault_in((u_long)s, num, 0);
 	u_int i;
 	for (i = 0; i < num; i++) {
 		printcharc(((char *)s)[i]);
@@ -117,12 +146,111 @@ static inline int is_illegal_va_range(u_long va, u_int len) {
 	return va + len < va || va < UTEMP || va + len > UTOP;
 }
 
+/* Overview:
+ *   Register 'func' as the user space handler of faults on unmapped pages in [lo, hi) of
+ *   'envid'. Such a fault no longer gets a fresh page: 'func' is called on the user exception
+ *   stack with the faulting context, whose 'cp0_badvaddr' is the address, and it's expected
+ *   to map the page and resume that context. A syscall that faulted is run again.
+ *
+ * Post-Condition:
+ *   Returns 0 on success. A 'func' of 0 unregisters the handler.
+ *   Returns -E_INVAL if [lo, hi) isn't a legal user address range.
+ *   Returns the original error if underlying calls fail.
+ */
+int sys_set_pgfault_entry(u_int envid, u_int func, u_int lo, u_int hi) {
+	struct Env *env;
+
+	if (lo > hi || is_illegal_va_range(lo, hi - lo)) {
+		return -E_INVAL;
+	}
+	try(envid2env(envid, &env, 1));
+	env->env_user_pgfault_entry = func;
+	env->env_user_pgfault_lo = func ? lo : 0;
+	env->env_user_pgfault_hi = func ? hi : 0;
+	return 0;
+}
+
+/* Overview:
+ *   Make sure the page at 'va' in the address space of 'e' is present if it's meant to be:
+ *   bring it back if it's swapped out, or fill it in if it's part of a lazy ELF segment.
+ *   If it's about to be mapped elsewhere with 'perm' including 'PTE_D' and it's the zero page or
+ *   a merged page (see 'ksm_scan') mapped copy-on-write, 'e' gets a copy of its own first, so
+ *   that both ends share writes.
+ *
+ * Post-Condition:
+ *   Return 0 if the page is present now or isn't mapped at all, or the original error if
+ *   underlying calls fail.
+ */
+static int page_fault_in(struct Env *e, u_long va, u_int perm) {
+	struct Page *pp;
+	Pte *pte;
+	int r;
+
+	try(swap_in(e->env_pgdir, e->env_asid, va));
+	if ((pp = page_lookup(e->env_pgdir, va, &pte)) == NULL) {
+		if ((r = lazy_fault(e, va)) != 0) {
+			return r == -E_INVAL ? 0 : r;
+		}
+		pp = page_lookup(e->env_pgdir, va, &pte);
+	}
+	if ((pp == zero_page || (pp->pp_flags & PP_KSM)) && (*pte & PTE_COW) && (perm & PTE_D)) {
+		struct Page *np;
+		void *src, *dst;
+
+		perm = ((*pte & 0xfff) & ~PTE_COW) | PTE_D;
+		if (pp == zero_page) {
+			try(page_alloc_user(&np));
+		} else {
+			try(page_alloc_user_nozero(&np));
+			src = kmap(pp);
+			dst = kmap(np);
+			memcpy(dst, src, PAGE_SIZE);
+			kunmap(dst);
+			kunmap(src);
+		}
+		if ((r = page_insert(e->env_pgdir, e->env_asid, np, ROUNDDOWN(va, PAGE_SIZE), perm)) !=
+		    0) {
+			page_free(np);
+			return r;
+		}
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Back the 'HUGE_PAIR_SIZE' bytes at 'va' in the address space of 'e' with one block of
+ *   contiguous pages mapped with 'perm', and make the range a superpage.
+ */
+static int mem_alloc_huge(struct Env *e, u_long va, u_int perm) {
+	struct Page *pp;
+	int r;
+
+	if (va % HUGE_PAIR_SIZE != 0 || is_illegal_va_range(va, HUGE_PAIR_SIZE)) {
+		return -E_INVAL;
+	}
+	try(page_alloc_pages(&pp, HUGE_PAIR_ORDER));
+	for (int i = 0; i < HUGE_PAIR_NPTE; i++) {
+		if ((r = page_insert(e->env_pgdir, e->env_asid, pp + i, va + i * PAGE_SIZE, perm)) !=
+		    0) {
+			// the pages mapped so far stay mapped, the rest go back
+			for (; i < HUGE_PAIR_NPTE; i++) {
+				page_free(pp + i);
+			}
+			return r;
+		}
+	}
+	return page_promote(e->env_pgdir, e->env_asid, va);
+}
+
 /* Overview:
  *   Allocate a physical page and map 'va' to it with 'perm' in the address space of 'envid'.
  *   If 'va' is already mapped, that original page is sliently unmapped.
  *   'envid2env' should be used with 'checkperm' set, like in most syscalls, to ensure the target is
  * either the caller or its child.
  *
+ *   If 'perm' has 'PTE_HUGE', the whole 'HUGE_PAIR_SIZE'-aligned range starting at 'va' is
+ *   allocated instead and mapped as a superpage.
+ *
  * Post-Condition:
  *   Return 0 on success.
  *   Return -E_BAD_ENV: 'checkperm' of 'envid2env' fails for 'envid'.
@@ -146,9 +274,12 @@ int sys_mem_alloc(u_int envid, u_int va, u_int perm) {
 	/* Hint: **Always** validate the permission in syscalls! */
 	/* Exercise 4.4: Your code here. (2/3) */
 	try(envid2env(envid, &env, 1));
-	/* Step 3: Allocate a physical page using 'page_alloc'. */
+	if (perm & PTE_HUGE) {
+		return mem_alloc_huge(env, va, perm & ~PTE_HUGE);
+	}
+	/* Step 3: Allocate a physical page using 'page_alloc_user'. */
 	/* Exercise 4.4: Your code here. (3/3) */
-	try(page_alloc(&pp));
+	try(page_alloc_user(&pp));
 	/* Step 4: Map the allocated page at 'va' with permission 'perm' using 'page_insert'. */
 	return page_insert(env->env_pgdir, env->env_asid, pp, va, perm);
 }
@@ -187,6 +318,7 @@ int sys_mem_map(u_int srcid, u_int srcva, u_int dstid, u_int dstva, u_int perm)
 	/* Step 4: Find the physical page mapped at 'srcva' in the address space of 'srcid'. */
 	/* Return -E_INVAL if 'srcva' is not mapped. */
 	/* Exercise 4.5: Your code here. (4/4) */
+	try(page_fault_in(srcenv, srcva, perm));
 	pp = page_lookup(srcenv->env_pgdir, srcva, NULL);
 	if (pp == NULL) {
 		return -E_INVAL;
@@ -217,7 +349,242 @@ int sys_mem_unmap(u_int envid, u_int va) {
 	/* Exercise 4.6: Your code here. (2/2) */
 	try(envid2env(envid, &e, 1));
 	/* Step 3: Unmap the physical page at 'va' in the address space of 'envid'. */
-	page_remove(e->env_pgdir, e->env_asid, va);
+	page_unmap(e->env_pgdir, e->env_asid, va);
+	return 0;
+}
+
+/* Overview:
+ *   Unmap the page mapped at 'va' in 'curenv' from every address space that maps it,
+ *   'curenv' included. The file system server evicts a block from its cache this way while
+ *   clients still have it mapped: they fault on it next time, and map it again.
+ *
+ * Post-Condition:
+ *   Return the number of mappings removed.
+ *   Return -E_BAD_ENV if 'curenv' isn't the file system server, as marked by the kernel when
+ *   it creates it ('env_fs', see 'env_init_fs'), whatever devices it uses. The pages of other envs are shared with envs they don't control, such
+ *   as their parents or the file system server, which would lose their data.
+ *   Return -E_INVAL if 'va' is illegal or not mapped writable in 'curenv'. Only a page the
+ *   caller may write to can be taken away from others, and never a copy-on-write one, whose
+ *   contents would be lost.
+ */
+int sys_mem_revoke(u_int va) {
+	struct Page *pp;
+	Pte *pte;
+
+	if (!curenv->env_fs) {
+		return -E_BAD_ENV;
+	}
+	if (is_illegal_va(va)) {
+		return -E_INVAL;
+	}
+	if ((pp = page_lookup(curenv->env_pgdir, va, &pte)) == NULL || !(*pte & PTE_D)) {
+		return -E_INVAL;
+	}
+	return page_unmap_all(pp);
+}
+
+/* Overview:
+ *   Set the number of pages the same-page merging scanner goes over each time the system is
+ *   idle to 'batch', 0 turning it off, unless 'batch' is negative. Then fill in '*info' with
+ *   the state of the scanner, unless 'info' is NULL.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_INVAL if 'info' is illegal.
+ */
+int sys_ksm_ctl(int batch, struct Ksm_info *info) {
+	if (info != NULL && is_illegal_va_range((u_long)info, sizeof(*info))) {
+		return -E_INVAL;
+	}
+	if (info != NULL) {
+		user_fault_in((u_long)info, sizeof(*info), 1);
+	}
+	if (batch >= 0) {
+		ksm_batch = batch;
+	}
+	if (info != NULL) {
+		ksm_info(info);
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Fill in '*st' with the memory usage of the system and of the pages env 'envid' maps in
+ *   [va, va + len), see 'struct Mem_stat'. Any env may be looked at, as nothing is changed.
+ *
+ * Post-Condition:
+ *   Return 0 on success, -E_BAD_ENV if 'envid' is invalid, or -E_INVAL if 'st' is illegal.
+ *   The part of the range above UTOP is ignored.
+ */
+int sys_mem_stat(u_int envid, u_int va, u_int len, struct Mem_stat *st) {
+	struct Env *e;
+
+	if (is_illegal_va_range((u_long)st, sizeof(*st))) {
+		return -E_INVAL;
+	}
+	try(envid2env(envid, &e, 0));
+	va = MIN(va, UTOP);
+	mem_stat(e->env_pgdir, va, MIN(len, UTOP - va), st);
+	return 0;
+}
+
+/* Overview:
+ *   Apply the single operation 'op' of 'sys_mem_batch', one page after the other.
+ *   'op->mo_done' counts the pages processed so far.
+ */
+static int mem_batch_op(struct Mem_op *op) {
+	struct Env *src, *dst;
+	struct Page *pp;
+	Pte *pte;
+	u_int type = op->mo_op & MEM_OP_TYPE;
+	u_long srcva, dstva;
+	u_int perm;
+	int r;
+
+	if (type > MEM_OP_PROTECT || op->mo_npage > (UTOP >> PGSHIFT) ||
+	    is_illegal_va_range(op->mo_dstva, op->mo_npage * PAGE_SIZE)) {
+		return -E_INVAL;
+	}
+	try(envid2env(op->mo_dstid, &dst, 1));
+	if (type == MEM_OP_MAP) {
+		if (is_illegal_va_range(op->mo_srcva, op->mo_npage * PAGE_SIZE)) {
+			return -E_INVAL;
+		}
+		try(envid2env(op->mo_srcid, &src, 1));
+	} else {
+		src = dst;
+	}
+
+	for (; op->mo_done < op->mo_npage; op->mo_done++) {
+		dstva = op->mo_dstva + op->mo_done * PAGE_SIZE;
+		srcva = type == MEM_OP_MAP ? op->mo_srcva + op->mo_done * PAGE_SIZE : dstva;
+		perm = op->mo_perm;
+
+		if (type == MEM_OP_ALLOC) {
+			try(page_alloc_user(&pp));
+			if ((r = page_insert(dst->env_pgdir, dst->env_asid, pp, dstva, perm)) != 0) {
+				page_free(pp);
+				return r;
+			}
+			continue;
+		}
+		if (type == MEM_OP_UNMAP) {
+			page_unmap(dst->env_pgdir, dst->env_asid, dstva);
+			continue;
+		}
+
+		/* MEM_OP_MAP and MEM_OP_PROTECT: (re)map the source page. */
+		try(page_fault_in(src, srcva, perm));
+		if ((pp = page_lookup(src->env_pgdir, srcva, &pte)) == NULL) {
+			if (op->mo_op & MEM_OP_SKIP) {
+				continue;
+			}
+			return -E_INVAL;
+		}
+		if ((op->mo_op & MEM_OP_LIBRARY) && !(*pte & PTE_LIBRARY)) {
+			continue;
+		}
+		if (op->mo_op & MEM_OP_KEEP) {
+			perm &= *pte & 0xfff;
+		}
+		try(page_insert(dst->env_pgdir, dst->env_asid, pp, dstva, perm));
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Apply the 'nops' memory operations in the array 'ops' in order, in a single trap.
+ *   Each one covers 'mo_npage' consecutive pages, see 'MEM_OP_*' in include/syscall.h.
+ *   'envid2env' is used with 'checkperm' set on every env involved, like in 'sys_mem_map'.
+ *
+ * Post-Condition:
+ *   Every 'mo_done' is set to the number of pages processed by its operation.
+ *   Return 0 if all operations succeed.
+ *   Return -E_INVAL if 'nops' exceeds 'MEM_BATCH_MAX' or 'ops' is illegal.
+ *   Otherwise, return the error of the first failing operation: the operations before it are
+ *   done, the pages before its 'mo_done' are done, and nothing after it is applied.
+ */
+int sys_mem_batch(struct Mem_op *ops, u_int nops) {
+	u_int i;
+
+	if (nops > MEM_BATCH_MAX || is_illegal_va_range((u_long)ops, nops * sizeof(*ops))) {
+		return -E_INVAL;
+	}
+	user_fault_in((u_long)ops, nops * sizeof(*ops), 1);
+	for (i = 0; i < nops; i++) {
+		ops[i].mo_done = 0;
+	}
+	for (i = 0; i < nops; i++) {
+		try(mem_batch_op(&ops[i]));
+	}
+	return 0;
+}
+
+/* Overview:
+ *   Give 'envid' the loadable ELF segment described by the program header at 'ph', whose file
+ *   data is at 'bin' in the address space of 'curenv', as a lazy segment: its pages are only
+ *   filled in when 'envid' first touches them.
+ *
+ * Post-Condition:
+ *   Return 0 on success.
+ *   Return -E_INVAL if the program header or the segment is illegal, or the file data isn't
+ *   all mapped in 'curenv'.
+ *   Return the original error if underlying calls fail.
+ *
+ * Hint:
+ *   The segment keeps a copy of the file data, taken now: 'curenv' may unmap it (and close the
+ *   file) right after the call, and the program doesn't change if the file is written to
+ *   while it runs. The pages of the file data are file system block cache pages, which the
+ *   file system server writes to in place, so they can't be used as they are.
+ */
+int sys_lazy_seg(u_int envid, const Elf32_Phdr *ph, u_int bin) {
+	struct Env *e;
+	struct Lazy_seg *ls;
+	struct Page *pp, *np;
+	void *src, *dst;
+	Elf32_Phdr phdr;
+	int r;
+
+	if (is_illegal_va_range((u_long)ph, sizeof(phdr))) {
+		return -E_INVAL;
+	}
+	phdr = *ph;
+	if (phdr.p_filesz > phdr.p_memsz || is_illegal_va_range(phdr.p_vaddr, phdr.p_memsz) ||
+	    is_illegal_va_range(bin, phdr.p_filesz)) {
+		return -E_INVAL;
+	}
+	try(envid2env(envid, &e, 1));
+
+	ls = lazy_seg_alloc(phdr.p_vaddr, phdr.p_memsz, phdr.p_filesz, PTE_V, bin % PAGE_SIZE);
+	if (ls == NULL) {
+		return -E_NO_MEM;
+	}
+	if (phdr.p_flags & PF_W) {
+		ls->ls_perm |= PTE_D;
+	}
+	for (u_int i = 0; i < ls->ls_npage; i++) {
+		u_long va = ROUNDDOWN(bin, PAGE_SIZE) + i * PAGE_SIZE;
+		// allocate first, which may swap pages out, then take the copy at once
+		if ((r = page_alloc_user_nozero(&np)) != 0) {
+			lazy_seg_free(ls);
+			return r;
+		}
+		ls->ls_pages[i] = np;
+		np->pp_ref++;
+		if ((r = page_fault_in(curenv, va, 0)) != 0) {
+			lazy_seg_free(ls);
+			return r;
+		}
+		if ((pp = page_lookup(curenv->env_pgdir, va, NULL)) == NULL) {
+			lazy_seg_free(ls);
+			return -E_INVAL;
+		}
+		src = kmap(pp);
+		dst = kmap(np);
+		memcpy(dst, src, PAGE_SIZE);
+		kunmap(dst);
+		kunmap(src);
+	}
+	lazy_seg_insert(e, ls);
 	return 0;
 }
 
@@ -229,7 +596,8 @@ int sys_mem_unmap(u_int envid, u_int va) {
  *   - The new env's 'env_tf' is copied from the kernel stack, except for $v0 set to 0 to indicate
  *     the return value in child.
  *   - The new env's 'env_status' is set to 'ENV_NOT_RUNNABLE'.
- *   - The new env's 'env_pri' is copied from 'curenv'.
+ *   - The new env's 'env_pri' is copied from 'curenv', and it's in the scheduling class of
+ *     'curenv' (see 'env_alloc').
  *   Returns the original error if underlying calls fail.
  *
  * Hint:
@@ -255,7 +623,119 @@ int sys_exofork(void) {
 }
 
 /* Overview:
- *   Set 'envid''s 'env_status' to 'status' and update 'env_sched_list'.
+ *   Create a runnable child of 'curenv' sharing its address space below 'USTACKTOP'
+ *   copy-on-write, all in one trap.
+ *
+ * Post-Condition:
+ *   Returns the child's envid on success, and
+ *   - The child's 'env_tf' is copied from the kernel stack, except for $v0 set to 0.
+ *   - The child's 'env_pri' and user exception handlers are copied from 'curenv', and it's in
+ *     the scheduling class of 'curenv' (see 'env_alloc').
+ *   Returns the original error if underlying calls fail, with no child left behind.
+ *
+ * Hint:
+ *   Writes to the shared pages are resolved by 'do_tlb_mod' in the kernel, so no user TLB Mod
+ *   entry is needed.
+ */
+int sys_fork(void) {
+	struct Env *e;
+	int r;
+
+	try(env_alloc(&e, curenv->env_id));
+	e->env_tf = *((struct Trapframe *)KSTACKTOP - 1);
+	e->env_tf.regs[2] = 0;
+	e->env_pri = curenv->env_pri;
+	e->env_user_tlb_mod_entry = curenv->env_user_tlb_mod_entry;
+	e->env_user_pgfault_entry = curenv->env_user_pgfault_entry;
+	e->env_user_pgfault_lo = curenv->env_user_pgfault_lo;
+	e->env_user_pgfault_hi = curenv->env_user_pgfault_hi;
+	// The child can't run before we return.
+	e->env_status = ENV_RUNNABLE;
+	sched_insert(e);
+
+	if ((r = env_dup_vm(e, curenv)) != 0) {
+		env_free(e);
+		return r;
+	}
+	return e->env_id;
+}
+
+/* Overview:
+ *   Freeze the not runnable child 'envid' of 'curenv' into a template, an image that
+ *   'sys_env_clone' copies into new envs. Its lazy ELF segments are filled in all at once, so
+ *   that its clones share every page from the start instead of each faulting them in.
+ *
+ * Post-Condition:
+ *   Return 0 on success. The template can't be made runnable, but may be destroyed, and is
+ *   when its parent is freed, see 'env_free'. It's no longer a child 'curenv' may wait for.
+ *   Return -E_INVAL if 'envid' is runnable or already a template.
+ *   Return the original error if underlying calls fail.
+ */
+int sys_env_template(u_int envid) {
+	struct Env *e;
+	struct Lazy_seg *ls;
+	u_long va;
+
+	try(envid2env(envid, &e, 1));
+	if (e->env_status != ENV_NOT_RUNNABLE || e->env_template) {
+		return -E_INVAL;
+	}
+	LIST_FOREACH (ls, &e->env_lazy_segs, ls_link) {
+		for (va = ROUNDDOWN(ls->ls_va, PAGE_SIZE); va < ls->ls_va + ls->ls_memsz;
+		     va += PAGE_SIZE) {
+			if (page_lookup(e->env_pgdir, va, NULL) == NULL) {
+				try(lazy_fault(e, va));
+			}
+		}
+	}
+	lazy_seg_free_all(e);
+	e->env_template = 1;
+	// a template never exits, so it isn't a child to wait for, see 'sys_wait'
+	curenv->env_nchild--;
+	return 0;
+}
+
+/* Overview:
+ *   Create a not runnable child of 'curenv' from the template 'tmplid', sharing its address
+ *   space copy-on-write and starting from its context, all in one trap.
+ *
+ * Post-Condition:
+ *   Return the child's envid on success, and
+ *   - The child's 'env_tf' and user exception handlers are copied from the template, and so
+ *     is its 'env_pri', but no higher than that of 'curenv' (see 'sys_set_env_pri'). Like a
+ *     forked child, it's in the scheduling class of 'curenv', whatever that of the template.
+ *   Return -E_INVAL if 'tmplid' isn't a template.
+ *   Return the original error if underlying calls fail, with no child left behind.
+ *
+ * Hint:
+ *   Any env may clone a template, not only its parent: a shell forks to run parts of a
+ *   command line, and its children use the templates it made.
+ */
+int sys_env_clone(u_int tmplid) {
+	struct Env *t, *e;
+	int r;
+
+	try(envid2env(tmplid, &t, 0));
+	if (!t->env_template) {
+		return -E_INVAL;
+	}
+	try(env_alloc(&e, curenv->env_id));
+	e->env_tf = t->env_tf;
+	e->env_pri = MIN(t->env_pri, curenv->env_pri);
+	e->env_user_tlb_mod_entry = t->env_user_tlb_mod_entry;
+	e->env_user_pgfault_entry = t->env_user_pgfault_entry;
+	e->env_user_pgfault_lo = t->env_user_pgfault_lo;
+	e->env_user_pgfault_hi = t->env_user_pgfault_hi;
+	e->env_status = ENV_NOT_RUNNABLE;
+	if ((r = env_dup_vm(e, t)) != 0) {
+		env_free(e);
+		return r;
+	}
+	return e->env_id;
+}
+
+/* Overview:
+ *   Set 'envid''s 'env_status' to 'status' and update the run queues.
  *
  * Post-Condition:
  *   Returns 0 on success.
@@ -263,7 +743,7 @@ int sys_exofork(void) {
  *   Returns the original error if underlying calls fail.
  *
  * Hint:
- *   The invariant that 'env_sched_list' contains and only contains all runnable envs should be
+ *   The invariant that the run queues contain and only contain all runnable envs should be
  *   maintained.
  */
 int sys_set_env_status(u_int envid, u_int status) {
@@ -277,12 +757,16 @@ int sys_set_env_status(u_int envid, u_int status) {
 	/* Step 2: Convert the envid to its corresponding 'struct Env *' using 'envid2env'. */
 	/* Exercise 4.14: Your code here. (2/3) */
 	try(envid2env(envid, &env, 1));
-	/* Step 3: Update 'env_sched_list' if the 'env_status' of 'env' is being changed. */
+	// a template never runs, only its clones do
+	if (env->env_template) {
+		return -E_INVAL;
+	}
+	/* Step 3: Update the run queues if the 'env_status' of 'env' is being changed. */
 	/* Exercise 4.14: Your code here. (3/3) */
 	if (status == ENV_RUNNABLE && env->env_status != ENV_RUNNABLE) {
-		TAILQ_INSERT_TAIL(&env_sched_list, env, env_sched_link);
+		sched_insert(env);
 	} else if (status == ENV_NOT_RUNNABLE && env->env_status != ENV_NOT_RUNNABLE) {
-		TAILQ_REMOVE(&env_sched_list, env, env_sched_link);
+		sched_remove(env);
 	}
 	/* Step 4: Set the 'env_status' of 'env'. */
 	env->env_status = status;
@@ -294,6 +778,60 @@ int sys_set_env_status(u_int envid, u_int status) {
 	return 0;
 }
 
+/* Overview:
+ *   Tell whether the kernel let 'curenv' schedule at will ('env_sched_priv', e.g. the file
+ *   system server, see 'env_init_fs'). Only such an env may raise its own priority or class,
+ *   or give its children more than it has itself.
+ */
+static inline int sched_privileged(void) {
+	return curenv->env_sched_priv;
+}
+
+/* Overview:
+ *   Set the priority 'env_pri' of 'envid' to 'pri', see 'ENV_NPRI'. A runnable env is put on
+ *   the run queues again with its new priority, and may run sooner or later than it would have.
+ *
+ * Post-Condition:
+ *   Return 0 on success, -E_INVAL if 'pri' is 0 or higher than the priority of 'curenv' (unless
+ *   it's privileged, see 'sched_privileged'), or the original error if 'envid' is invalid.
+ *   An env may thus lower its own priority, but never raise it.
+ */
+int sys_set_env_pri(u_int envid, u_int pri) {
+	struct Env *env;
+
+	if (pri == 0 || (pri > curenv->env_pri && !sched_privileged())) {
+		return -E_INVAL;
+	}
+	try(envid2env(envid, &env, 1));
+	sched_set_pri(env, pri);
+	return 0;
+}
+
+/* Overview:
+ *   Move 'envid' to the scheduling class 'class', 'ENV_SCHED_FAIR' or 'ENV_SCHED_PRIO'.
+ *
+ * Post-Condition:
+ *   Return 0 on success, -E_INVAL if 'class' is neither, or the original error if 'envid' is
+ *   invalid.
+ *   Return -E_INVAL if 'class' is 'ENV_SCHED_PRIO' and 'curenv' is neither in it nor
+ *   privileged (see 'sched_privileged'): as it runs before the fair class, only an env that
+ *   was given the priority class may pass it on to its children.
+ */
+int sys_set_env_sched(u_int envid, u_int class) {
+	struct Env *env;
+
+	if (class != ENV_SCHED_FAIR && class != ENV_SCHED_PRIO) {
+		return -E_INVAL;
+	}
+	if (class == ENV_SCHED_PRIO && curenv->env_sched_class != ENV_SCHED_PRIO &&
+	    !sched_privileged()) {
+		return -E_INVAL;
+	}
+	try(envid2env(envid, &env, 1));
+	sched_set_class(env, class);
+	return 0;
+}
+
 /* Overview:
  *  Set envid's trap frame to 'tf'.
  *
@@ -309,14 +847,18 @@ int sys_set_trapframe(u_int envid, struct Trapframe *tf) {
 		return -E_INVAL;
 	}
 	struct Env *env;
+	struct Trapframe tmp_tf;
 	try(envid2env(envid, &env, 1));
+	// A fault on 'tf' restarts the syscall from the context below 'KSTACKTOP', so take a
+	// whole copy before overwriting that, see 'user_fault_in'.
+	tmp_tf = *tf;
 	if (env == curenv) {
-		*((struct Trapframe *)KSTACKTOP - 1) = *tf;
+		*((struct Trapframe *)KSTACKTOP - 1) = tmp_tf;
 		// return `tf->regs[2]` instead of 0, because return value overrides regs[2] on
 		// current trapframe.
-		return tf->regs[2];
+		return tmp_tf.regs[2];
 	} else {
-		env->env_tf = *tf;
+		env->env_tf = tmp_tf;
 		return 0;
 	}
 }
@@ -351,16 +893,62 @@ int sys_ipc_recv(u_int dstva) {
 	/* Step 3: Set the value of 'curenv->env_ipc_dstva'. */
 	/* Exercise 4.8: Your code here. (2/8) */
 	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_handoff = 0;
+	sched_wait(curenv, NULL);
 	/* Step 4: Set the status of 'curenv' to 'ENV_NOT_RUNNABLE' and remove it from
-	 * 'env_sched_list'. */
+	 * the run queues. */
 	/* Exercise 4.8: Your code here. (3/8) */
 	curenv->env_status = ENV_NOT_RUNNABLE;
-	TAILQ_REMOVE(&env_sched_list, curenv, env_sched_link);
+	sched_remove(curenv);
 	/* Step 5: Give up the CPU and block until a message is received. */
 	((struct Trapframe *)KSTACKTOP - 1)->regs[2] = 0;
 	schedule(1);
 }
 
+/* Overview:
+ *   Deliver a 'value' (together with a page if 'srcva' is not 0) from 'curenv' to 'e', the way
+ *   'sys_ipc_try_send' describes.
+ */
+static int ipc_deliver(struct Env *e, u_int value, u_int srcva, u_int perm) {
+	struct Page *p;
+
+	/* Step 3: Check if the target is waiting for a message. */
+	/* Exercise 4.8: Your code here. (6/8) */
+	if (e->env_ipc_recving == 0) {
+		return -E_IPC_NOT_RECV;
+	}
+	/* Hint: bring in 'srcva' if it's swapped out or not loaded yet, before the target is
+	 * touched. */
+	if (srcva != 0) {
+		try(page_fault_in(curenv, srcva, perm));
+	}
+	/* Step 4: Set the target's ipc fields. */
+	e->env_ipc_value = value;
+	e->env_ipc_from = curenv->env_id;
+	e->env_ipc_perm = PTE_V | perm;
+	e->env_ipc_recving = 0;
+	// whatever it waited for, it's got an answer
+	sched_wait(e, NULL);
+
+	/* Step 5: Set the target's status to 'ENV_RUNNABLE' again and insert it to the tail of
+	 * its run queue. */
+	/* Exercise 4.8: Your code here. (7/8) */
+	e->env_status = ENV_RUNNABLE;
+	sched_insert(e);
+	/* Step 6: If 'srcva' is not zero, map the page at 'srcva' in 'curenv' to 'e->env_ipc_dstva'
+	 * in 'e'. */
+	/* Return -E_INVAL if 'srcva' is not zero and not mapped in 'curenv'. */
+	if (srcva != 0) {
+		/* Exercise 4.8: Your code here. (8/8) */
+		p = page_lookup(curenv->env_pgdir, srcva, NULL);
+		if (p == NULL) {
+			return -E_INVAL;
+		}
+		try(page_insert(e->env_pgdir, e->env_asid, p, e->env_ipc_dstva, perm));
+	}
+	return 0;
+}
+
 /* Overview:
  *   Try to send a 'value' (together with a page if 'srcva' is not 0) to the target env 'envid'.
  *
@@ -372,6 +960,8 @@ int sys_ipc_recv(u_int dstva) {
  *   - 'env_status' is set to 'ENV_RUNNABLE' again to recover from 'ipc_recv'.
  *   - if 'srcva' is not NULL, map 'env_ipc_dstva' to the same page mapped at 'srcva' in 'curenv'
  *     with 'perm'.
+ *   If the target is waiting in 'sys_ipc_call', i.e. this is the reply it waits for, switch
+ *   straight to it, 'curenv' going on later from where it is in the run queues.
  *
  *   Return -E_IPC_NOT_RECV if the target has not been waiting for an IPC message with
  *   'sys_ipc_recv'.
@@ -379,7 +969,6 @@ int sys_ipc_recv(u_int dstva) {
  */
 int sys_ipc_try_send(u_int envid, u_int value, u_int srcva, u_int perm) {
 	struct Env *e;
-	struct Page *p;
 
 	/* Step 1: Check if 'srcva' is either zero or a legal address. */
 	/* Exercise 4.8: Your code here. (4/8) */
@@ -391,40 +980,64 @@ int sys_ipc_try_send(u_int envid, u_int value, u_int srcva, u_int perm) {
 	 * because the target env is not restricted to 'curenv''s children. */
 	/* Exercise 4.8: Your code here. (5/8) */
 	try(envid2env(envid, &e, 0));
-	/* Step 3: Check if the target is waiting for a message. */
-	/* Exercise 4.8: Your code here. (6/8) */
-	if (e->env_ipc_recving == 0) {
-		return -E_IPC_NOT_RECV;
+	/* Steps 3 to 6: see 'ipc_deliver'. */
+	try(ipc_deliver(e, value, srcva, perm));
+
+	if (e->env_ipc_handoff) {
+		((struct Trapframe *)KSTACKTOP - 1)->regs[2] = 0;
+		sched_handoff(e);
 	}
-	/* Step 4: Set the target's ipc fields. */
-	e->env_ipc_value = value;
-	e->env_ipc_from = curenv->env_id;
-	e->env_ipc_perm = PTE_V | perm;
-	e->env_ipc_recving = 0;
+	return 0;
+}
 
-	/* Step 5: Set the target's status to 'ENV_RUNNABLE' again and insert it to the tail of
-	 * 'env_sched_list'. */
-	/* Exercise 4.8: Your code here. (7/8) */
-	e->env_status = ENV_RUNNABLE;
-	TAILQ_INSERT_TAIL(&env_sched_list, e, env_sched_link);
-	/* Step 6: If 'srcva' is not zero, map the page at 'srcva' in 'curenv' to 'e->env_ipc_dstva'
-	 * in 'e'. */
-	/* Return -E_INVAL if 'srcva' is not zero and not mapped in 'curenv'. */
-	if (srcva != 0) {
-		/* Exercise 4.8: Your code here. (8/8) */
-		p = page_lookup(curenv->env_pgdir, srcva, NULL);
-		if (p == NULL) {
-			return -E_INVAL;
+/* Overview:
+ *   Send a message to 'envid' as 'sys_ipc_try_send' does, then wait for one at 'dstva' as
+ *   'sys_ipc_recv' does, in one go. Instead of waiting for its turn on the run queues, the
+ *   target runs at once on the rest of our time slice, and its reply switches straight back
+ *   to us the same way. A request to a server so gets served, and its reply received, without
+ *   waiting for the other runnable envs in between. Until we get a message, the target runs at
+ *   our priority if it's higher than its own, see 'sched_wait'. That also holds while the
+ *   target isn't ready for the message yet and we try again.
+ *
+ * Post-Condition:
+ *   Return 0 once a message is received.
+ *   Return -E_INVAL if 'dstva' is neither 0 nor a legal address. Otherwise, if the message
+ *   can't be sent, return the error 'sys_ipc_try_send' would and don't wait.
+ */
+int sys_ipc_call(u_int envid, u_int value, u_int srcva, u_int perm, u_int dstva) {
+	struct Env *e;
+	int r;
+
+	if ((srcva != 0 && is_illegal_va(srcva)) || (dstva != 0 && is_illegal_va(dstva))) {
+		return -E_INVAL;
+	}
+	try(envid2env(envid, &e, 0));
+	// 'e' serves us from now on, and we wait for it to be ready even if it's still busy
+	// serving others, so it inherits our priority either way
+	if ((r = ipc_deliver(e, value, srcva, perm)) != 0) {
+		if (r == -E_IPC_NOT_RECV) {
+			sched_wait(curenv, e);
 		}
-		try(page_insert(e->env_pgdir, e->env_asid, p, e->env_ipc_dstva, perm));
+		return r;
 	}
-	return 0;
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_handoff = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_remove(curenv);
+	sched_wait(curenv, e);
+	((struct Trapframe *)KSTACKTOP - 1)->regs[2] = 0;
+	sched_handoff(e);
 }
 
 // XXX: kernel does busy waiting here, blocking all envs
 int sys_cgetc(void) {
 	int ch;
 	while ((ch = scancharc()) == 0) {
+		// nothing to do until a key arrives, so get some pages zeroed or merged meanwhile
+		page_zero_refill(1);
+		ksm_idle();
 	}
 	return ch;
 }
@@ -470,6 +1083,9 @@ int sys_write_dev(u_int va, u_int pa, u_int len) {
 		return -E_INVAL;
 	}
 
+	if (0x180001f0 <= pa && pa + len <= 0x180001f8) {
+		curenv->env_disk = 1;
+	}
 	if ((0x180003f8 <= pa && pa + len <= 0x18000418) ||
 	    (0x180001f0 <= pa && pa + len <= 0x180001f8)) {
 		// 调用 memcpy 从内存向设备写入
@@ -490,6 +1106,10 @@ int sys_write_dev(u_int va, u_int pa, u_int len) {
  *  Data at 'pa' is copied from device to [va, va+len).
  *  Return 0 on success.
  *  Return -E_INVAL on bad address.
+ *  An env that gets to the IDE disk this way is marked 'env_disk' ('sys_write_dev' does the
+ *  same), as the file system server is from the start (see 'env_init_fs'). It isn't swapped
+ *  out from then on: while a PIO transfer is under way, the disk can't be used to bring back
+ *  one of its pages, and only the env itself can finish the transfer.
  *
  * Hint:
  *  You can use 'is_illegal_va_range' to validate 'va'.
@@ -505,8 +1125,13 @@ int sys_read_dev(u_int va, u_int pa, u_int len) {
 		return -E_INVAL;
 	}
 
+	if (0x180001f0 <= pa && pa + len <= 0x180001f8) {
+		curenv->env_disk = 1;
+	}
 	if ((0x180003f8 <= pa && pa + len <= 0x18000418) ||
 	    (0x180001f0 <= pa && pa + len <= 0x180001f8)) {
+		// reading the device consumes the data, so 'va' mustn't fault after that
+		user_fault_in(va, len, 1);
 		// 调用 memcpy 从设备读入内存
 		memcpy((void *)va, (void *)(KSEG1 | pa), len);
 		return 0;
@@ -521,6 +1146,53 @@ void sys_exit(u_int status) {
 	env_destroy(curenv);
 }
 
+/* Overview:
+ *   Wait for the child 'envid' of 'curenv' to exit, or for any child if 'envid' is 0, and get
+ *   its exit status. 'curenv' is blocked until then, unless a child it waits for has already
+ *   exited.
+ *
+ * Post-Condition:
+ *   Return the envid of the child, with its exit status in 'curenv->env_wait_status'.
+ *   Return -E_BAD_ENV if 'envid' isn't a child of 'curenv' (or if 'envid' is 0, 'curenv' has
+ *   no child), alive or exited and not waited for yet. Templates (see 'sys_env_template')
+ *   don't count, as they never exit.
+ */
+int sys_wait(u_int envid) {
+	struct Env_exit *ee;
+	struct Env *e;
+	int r;
+
+	/* Step 1: Take the status of a child that exited already, if any. */
+	LIST_FOREACH (ee, &curenv->env_exits, ee_link) {
+		if (envid == 0 || ee->ee_id == envid) {
+			r = ee->ee_id;
+			curenv->env_wait_status = ee->ee_status;
+			LIST_REMOVE(ee, ee_link);
+			kfree(ee);
+			return r;
+		}
+	}
+
+	/* Step 2: Check that there's a child alive to wait for. */
+	if (envid == 0) {
+		if (curenv->env_nchild == 0) {
+			return -E_BAD_ENV;
+		}
+	} else {
+		try(envid2env(envid, &e, 1));
+		if (e == curenv || e->env_template) {
+			return -E_BAD_ENV;
+		}
+	}
+
+	/* Step 3: Block until it exits, see 'env_exit_notify'. */
+	curenv->env_wait_recving = 1;
+	curenv->env_wait_id = envid;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_remove(curenv);
+	schedule(1);
+}
+
 void *syscall_table[MAX_SYSNO] = {
     [SYS_putchar] = sys_putchar,
     [SYS_print_cons] = sys_print_cons,
@@ -541,6 +1213,19 @@ void *syscall_table[MAX_SYSNO] = {
     [SYS_write_dev] = sys_write_dev,
     [SYS_read_dev] = sys_read_dev,
 	[SYS_exit] = sys_exit,
+    [SYS_fork] = sys_fork,
+    [SYS_mem_batch] = sys_mem_batch,
+    [SYS_lazy_seg] = sys_lazy_seg,
+    [SYS_env_template] = sys_env_template,
+    [SYS_env_clone] = sys_env_clone,
+    [SYS_set_pgfault_entry] = sys_set_pgfault_entry,
+    [SYS_mem_revoke] = sys_mem_revoke,
+    [SYS_ksm_ctl] = sys_ksm_ctl,
+    [SYS_mem_stat] = sys_mem_stat,
+    [SYS_set_env_pri] = sys_set_env_pri,
+    [SYS_set_env_sched] = sys_set_env_sched,
+    [SYS_ipc_call] = sys_ipc_call,
+    [SYS_wait] = sys_wait,
 };
 
 /* Overview:
@@ -1,6 +1,14 @@
 #include <bitops.h>
 #include <env.h>
+#include <ksm.h>
 #include <pmap.h>
+#include <printk.h>
+#include <sched.h>
+#include <swap.h>
+
+// The generation of the env ASIDs handed out now, see 'asid_alloc'. It's defined here rather
+// than in env.c, so that the TLB is managed the same way in a kernel without envs.
+u_int asid_generation = 1;
 
 /* Lab 2 Key Code "tlb_invalidate" */
 /* Overview:
@@ -9,14 +17,70 @@
  * Hint:
  *   Construct a new Entry HI and call 'tlb_out' to flush TLB.
  *   'tlb_out' is defined in mm/tlb_asm.S
+ *   An env ASID from an older generation has nothing left in the TLB: the whole TLB was flushed
+ *   when its generation ended, and its hardware ASID may belong to another env by now.
  */
 void tlb_invalidate(u_int asid, u_long va) {
+	if (ASID_GEN(asid) != 0 && ASID_GEN(asid) != asid_generation) {
+		return;
+	}
 	tlb_out((va & ~GENMASK(PGSHIFT, 0)) | (asid & (NASID - 1)));
 }
 /* End of Key Code "tlb_invalidate" */
 
-static void passive_alloc(u_int va, Pde *pgdir, u_int asid) {
+/* Overview:
+ *   Invalidate the TLB entry of 'va' like 'tlb_invalidate', and tell whether there was one.
+ *   As entries only come in by refills, this tells whether the pair of pages at 'va' has been
+ *   used since its entry was last invalidated (or pushed out by newer ones).
+ */
+int tlb_invalidate_used(u_int asid, u_long va) {
+	if (ASID_GEN(asid) != asid_generation) {
+		return 0;
+	}
+	return tlb_out((va & ~GENMASK(PGSHIFT, 0)) | (asid & (NASID - 1)));
+}
+
+/* Overview:
+ *   Invalidate every TLB entry of the env ASID 'asid' with one sweep of the TLB.
+ *
+ * Hint:
+ *   Nothing is left to do for an ASID of an older generation, or for an env that never ran.
+ */
+void tlb_invalidate_asid(u_int asid) {
+	if (ASID_GEN(asid) != asid_generation) {
+		return;
+	}
+	tlb_flush_asid(asid & (NASID - 1));
+}
+
+// TLB refills handled by the assembly fast path in entry.S, and those it passed on to
+// '_do_tlb_refill' (TLB invalid exceptions, which never go through it, aren't counted).
+u_int tlb_refill_fast;
+u_int tlb_refill_slow;
+
+/* Overview:
+ *   Tell whether the TLB miss being handled was caused by a store (TLBS) rather than a load
+ *   (TLBL), from the exception code CP0 Cause still holds.
+ */
+static int tlb_miss_is_store(void) {
+	u_int cause;
+
+	asm("mfc0 %0, $13" : "=r"(cause) :);
+	return ((cause >> 2) & 0x1f) == 3;
+}
+
+/* Overview:
+ *   Back the faulting address 'va' with memory on first touch.
+ *   A load only maps the shared zero page, copy-on-write: a page is allocated by 'cow_resolve'
+ *   on the first store, so memory that is only ever read costs nothing. A store gets a page
+ *   of its own right away, saving the TLB Mod exception that would follow.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_NO_MEM if there's no memory left for the page.
+ */
+static int passive_alloc(u_int va, Pde *pgdir, u_int asid, int store) {
 	struct Page *p = NULL;
+	int r;
 
 	if (va < UTEMP) {
 		panic("address too low");
@@ -38,39 +102,182 @@ static void passive_alloc(u_int va, Pde *pgdir, u_int asid) {
 		panic("kernel address");
 	}
 
-	panic_on(page_alloc(&p));
-	panic_on(page_insert(pgdir, asid, p, PTE_ADDR(va), (va >= UVPT && va < ULIM) ? 0 : PTE_D));
+	if (va >= UVPT && va < ULIM) {
+		try(page_alloc(&p));
+		if ((r = page_insert(pgdir, asid, p, PTE_ADDR(va), 0)) != 0) {
+			page_free(p);
+		}
+		return r;
+	}
+
+#if !defined(LAB) || LAB >= 4
+	if (!store) {
+		// 'page_insert' turns 'PTE_D' into 'PTE_COW' for the zero page
+		return page_insert(pgdir, asid, zero_page_get(), PTE_ADDR(va), PTE_D);
+	}
+#endif
+	try(page_alloc_user(&p));
+	if ((r = page_insert(pgdir, asid, p, PTE_ADDR(va), PTE_D)) != 0) {
+		page_free(p);
+	}
+	return r;
+}
+
+/* Overview:
+ *   Give up on the TLB miss at 'va', which failed with 'r' as neither memory nor swap space is
+ *   left: destroy 'curenv', like 'do_tlb_mod' does, so that the other envs go on. Without an
+ *   env to blame (before lab 3, or a fault of the kernel itself), it's a kernel panic.
+ */
+static void __attribute__((noreturn)) tlb_refill_fail(u_long va, int r) {
+#if !defined(LAB) || LAB >= 3
+	if (curenv != NULL) {
+		printk("[%08x] page fault at %x failed: %d\n", curenv->env_id, va, r);
+		env_destroy(curenv);
+	}
+#endif
+	panic("page fault at %x failed: %d", va, r);
 }
 
+#if !defined(LAB) || LAB >= 4
+/* Overview:
+ *   Hand the fault on the unmapped page at 'va' over to the user space page fault handler of
+ *   'curenv', the way 'do_tlb_mod' hands TLB Mod exceptions over, and go back to user space.
+ *
+ * Hint:
+ *   The fault may come from the kernel touching user memory in a syscall. The context is then
+ *   the syscall's, which is moved back to run the syscall again once the page is mapped. Such
+ *   a syscall faults its user memory in before any side effect, see 'user_fault_in'.
+ */
+static void __attribute__((noreturn)) pgfault_upcall(u_long va) {
+	struct Trapframe *tf = (struct Trapframe *)KSTACKTOP - 1;
+	struct Trapframe tmp_tf;
+
+	if (((tf->cp0_cause >> 2) & 0x1f) == 8) {
+		tf->cp0_epc -= 4;
+	}
+	tmp_tf = *tf;
+	tmp_tf.cp0_badvaddr = va;
+
+	if (tf->regs[29] < USTACKTOP || tf->regs[29] >= UXSTACKTOP) {
+		tf->regs[29] = UXSTACKTOP;
+	}
+	tf->regs[29] -= sizeof(struct Trapframe);
+	*(struct Trapframe *)tf->regs[29] = tmp_tf;
+	tf->regs[4] = tf->regs[29];
+	tf->regs[29] -= sizeof(tf->regs[4]);
+	tf->cp0_epc = curenv->env_user_pgfault_entry;
+	schedule(0);
+}
+#endif
+
 /* Overview:
  *  Refill TLB.
+ *
+ * Post-Condition:
+ *  The even and odd EntryLo values of the pair covering 'va' are stored in 'pentrylo[0..1]'.
+ *  Return the PageMask to write them with: 0 for ordinary pages, or 'PAGEMASK_HUGE' if 'va'
+ *  is part of a superpage.
  */
-void _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid) {
+u_int _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid) {
+	int store = tlb_miss_is_store();
 	tlb_invalidate(asid, va);
 	Pte *ppte;
+	int r;
 	/* Hints:
 	 *  Invoke 'page_lookup' repeatedly in a loop to find the page table entry '*ppte'
 	 * associated with the virtual address 'va' in the current address space 'cur_pgdir'.
 	 *
 	 *  **While** 'page_lookup' returns 'NULL', indicating that the '*ppte' could not be found,
 	 *  allocate a new page using 'passive_alloc' until 'page_lookup' succeeds.
+	 *
+	 *  A page that was swapped out is read back from disk with 'swap_in' first, and a page of
+	 *  a lazy ELF segment of 'curenv' is filled in by 'lazy_fault' instead of 'passive_alloc'.
+	 *  A page in the range of the user space page fault handler of 'curenv' is left to it.
+	 *  If there's no memory for the page, 'curenv' is destroyed, see 'tlb_refill_fail'.
 	 */
 
 	/* Exercise 2.9: Your code here. */
+	if ((r = swap_in(cur_pgdir, asid, va)) != 0) {
+		tlb_refill_fail(va, r);
+	}
 	while (page_lookup(cur_pgdir, va, &ppte) == NULL) {
-		passive_alloc(va, cur_pgdir, asid);
+#if !defined(LAB) || LAB >= 3
+		if (curenv != NULL && (r = lazy_fault(curenv, va)) != -E_INVAL) {
+			if (r != 0) {
+				tlb_refill_fail(va, r);
+			}
+			continue;
+		}
+#endif
+#if !defined(LAB) || LAB >= 4
+		if (curenv != NULL && va >= curenv->env_user_pgfault_lo &&
+		    va < curenv->env_user_pgfault_hi) {
+			pgfault_upcall(va);
+		}
+#endif
+		if ((r = passive_alloc(va, cur_pgdir, asid, store)) != 0) {
+			tlb_refill_fail(va, r);
+		}
+	}
+
+	if (*ppte & PTE_HUGE) {
+		// each half of the pair is a large page starting at its first entry
+		ppte -= PTX(va) & (HUGE_PAIR_NPTE - 1);
+		pentrylo[0] = ppte[0] >> 6;
+		pentrylo[1] = ppte[HUGE_PAIR_NPTE / 2] >> 6;
+		return PAGEMASK_HUGE;
 	}
 
 	ppte = (Pte *)((u_long)ppte & ~0x7);
 	pentrylo[0] = ppte[0] >> 6;
 	pentrylo[1] = ppte[1] >> 6;
+	return 0;
 }
 
 #if !defined(LAB) || LAB >= 4
+/* Overview:
+ *   Resolve a write to the copy-on-write page mapped by '*pte' at 'va' in the current address
+ *   space: map a private writable copy of it, or the page itself if no one else maps it.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_NO_MEM if there's no free page for the copy.
+ */
+static int cow_resolve(Pte *pte, u_long va, u_int asid) {
+	struct Page *pp = pa2page(*pte);
+	struct Page *np;
+	u_int perm = ((*pte & 0xfff) & ~(PTE_COW | PTE_HUGE)) | PTE_D;
+	void *src, *dst;
+	int r;
+
+	va = ROUNDDOWN(va, PAGE_SIZE);
+	if (pp->pp_ref == 1) {
+		// a merged page whose other mappings are gone is ours again
+		ksm_unmerge(pp);
+		return page_insert(cur_pgdir, asid, pp, va, perm);
+	}
+	if (pp == zero_page) {
+		// no need to copy zeros over, a pre-zeroed page will do
+		try(page_alloc_user(&np));
+	} else {
+		try(page_alloc_user_nozero(&np));
+		src = kmap(pp);
+		dst = kmap(np);
+		memcpy(dst, src, PAGE_SIZE);
+		kunmap(dst);
+		kunmap(src);
+	}
+	if ((r = page_insert(cur_pgdir, asid, np, va, perm)) != 0) {
+		page_free(np);
+	}
+	return r;
+}
+
 /* Overview:
  *   This is the TLB Mod exception handler in kernel.
- *   Our kernel allows user programs to handle TLB Mod exception in user mode, so we copy its
- *   context 'tf' into UXSTACK and modify the EPC to the registered user exception entry.
+ *   A write to a 'PTE_COW' page is resolved by the kernel itself with 'cow_resolve'. If that
+ *   fails, the env is destroyed, unless it registered a user handler to deal with it.
+ *   Our kernel allows user programs to handle other TLB Mod exceptions in user mode, so we copy
+ *   its context 'tf' into UXSTACK and modify the EPC to the registered user exception entry.
  *
  * Hints:
  *   'env_user_tlb_mod_entry' is the user space entry registered using
@@ -80,14 +287,27 @@ void _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid) {
  */
 void do_tlb_mod(struct Trapframe *tf) {
 	struct Trapframe tmp_tf = *tf;
+	Pte *pte;
+	int r;
+
+	// Copy-on-write pages are resolved right here, without a trip to user space.
+	if (page_lookup(cur_pgdir, tf->cp0_badvaddr, &pte) && (*pte & PTE_COW)) {
+		if ((r = cow_resolve(pte, tf->cp0_badvaddr, curenv->env_asid)) == 0) {
+			return;
+		}
+		if (!curenv->env_user_tlb_mod_entry) {
+			// there's no memory for the copy: the env can't go on, but the others can
+			printk("[%08x] copy-on-write fault at %x failed: %d\n", curenv->env_id,
+			       tf->cp0_badvaddr, r);
+			env_destroy(curenv);
+		}
+	}
 
 	if (tf->regs[29] < USTACKTOP || tf->regs[29] >= UXSTACKTOP) {
 		tf->regs[29] = UXSTACKTOP;
 	}
 	tf->regs[29] -= sizeof(struct Trapframe);
 	*(struct Trapframe *)tf->regs[29] = tmp_tf;
-	Pte *pte;
-	page_lookup(cur_pgdir, tf->cp0_badvaddr, &pte);
 	if (curenv->env_user_tlb_mod_entry) {
 		tf->regs[4] = tf->regs[29];
 		tf->regs[29] -= sizeof(tf->regs[4]);
@@ -41,7 +41,7 @@ endif
 include/generated:
 	mkdir -p include/generated
 
-.PHONY: all-test init-override init-envs
+.PHONY: all-test init-override init-envs qemu-mem
 
 ifneq ($(init-override),)
 init-override: $(test_dir) include/generated
@@ -63,3 +63,10 @@ pre-env-run: $(test_dir) include/generated
 
 init: pre-env-run
 endif
+
+ifneq ($(qemu-mem),)
+qemu-mem: $(target_dir)
+	echo $(qemu-mem) > $(qemu_mem)
+
+all: qemu-mem
+endif
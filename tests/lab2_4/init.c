@@ -0,0 +1,17 @@
+#include <pmap.h>
+
+void mips_init(u_int argc, char **argv, char **penv, u_int ram_low_size) {
+	printk("init.c:\tmips_init() is called\n");
+	mips_detect_memory(ram_low_size);
+	mips_detect_highmem(penv);
+	mips_vm_init();
+	page_init();
+
+	buddy_check();
+	superpage_check();
+	rmap_check();
+	pgtable_check();
+	highmem_check();
+	page_check();
+	halt();
+}
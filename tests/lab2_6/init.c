@@ -0,0 +1,18 @@
+#include <pmap.h>
+
+void mips_init(u_int argc, char **argv, char **penv, u_int ram_low_size) {
+	printk("init.c:\tmips_init() is called\n");
+	mips_detect_memory(ram_low_size);
+	mips_detect_highmem(penv);
+	// booted with 512 MiB, of which only 256 MiB are reachable through KSEG0
+	assert(npage > npage_low);
+	mips_vm_init();
+	page_init();
+
+	buddy_check();
+	rmap_check();
+	pgtable_check();
+	highmem_check();
+	page_check();
+	halt();
+}
@@ -0,0 +1,2 @@
+init-override := $(test_dir)/init.c
+qemu-mem := 512
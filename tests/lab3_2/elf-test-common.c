@@ -27,13 +27,23 @@ void mem_eqz(const char *a, u_long size) {
 	}
 }
 
-void seg_check(Pde *pgdir, u_long va, const char *std, u_long size) {
+// Look up the page at 'va' in 'e', filling it in first if it wasn't touched yet.
+Pte *seg_page(struct Env *e, u_long va) {
+	Pte *pte;
+	if (page_lookup(e->env_pgdir, va, &pte) == NULL) {
+		assert(lazy_fault(e, va) == 0);
+		assert(page_lookup(e->env_pgdir, va, &pte));
+	}
+	return pte;
+}
+
+void seg_check(struct Env *e, u_long va, const char *std, u_long size) {
 	printk("segment check: %x - %x (%d)\n", va, va + size, size);
 	Pte *pte;
 	u_long off = va - ROUNDDOWN(va, PAGE_SIZE), i;
 	if (off) {
 		u_long n = MIN(size, PAGE_SIZE - off);
-		assert(page_lookup(pgdir, va - off, &pte));
+		pte = seg_page(e, va - off);
 		if (std) {
 			mem_eq((char *)KADDR(PTE_ADDR(*pte)) + off, std, n);
 			std += n;
@@ -46,7 +56,7 @@ void seg_check(Pde *pgdir, u_long va, const char *std, u_long size) {
 
 	for (i = 0; i < size; i += PAGE_SIZE) {
 		u_long n = MIN(size - i, PAGE_SIZE);
-		assert(page_lookup(pgdir, va + i, &pte));
+		pte = seg_page(e, va + i);
 		if (std) {
 			mem_eq((char *)KADDR(PTE_ADDR(*pte)), std + i, n);
 		} else {
@@ -24,17 +24,30 @@ if __name__ == '__main__':
             print(f'0x{b:x},', end='', sep='')
         print('\n};\n')
 
+    print(f'extern u_char binary_test_{case}_start[];\n')
     print(f'''void load_icode_check() {{
     printk("testing load_icode for {case}\\n");
     struct Env *e = ENV_CREATE(test_{case});\
 ''')
 
+    # Nothing is loaded before it's touched.
+    for va, _, _ in segs:
+        print(f'    assert(page_lookup(e->env_pgdir, 0x{va:x}, NULL) == NULL);')
+
     for i, (va, data, h) in enumerate(segs):
         n = len(data)
         std = f'{case}_{va:x}'
         print(f'''    // Segment at 0x{va:x}, memsz={h.p_memsz}, filesz={h.p_filesz}
-    seg_check(e->env_pgdir, 0x{va:x}, {std}, sizeof {std});''')
+    seg_check(e, 0x{va:x}, {std}, sizeof {std});''')
         if h.p_memsz != n:
-            print(f'    seg_check(e->env_pgdir, 0x{va + n:x}, NULL, {h.p_memsz - n});')
+            print(f'    seg_check(e, 0x{va + n:x}, NULL, {h.p_memsz - n});')
+    # Whole pages of read-only segments are the pages of the image itself.
+    for va, data, h in segs:
+        page = (va + 4095) & ~4095
+        if not (h.p_flags & 2) and (h.p_offset - va) % 4096 == 0 and \
+                page + 4096 <= va + h.p_filesz:
+            off = h.p_offset + page - va
+            print(f'''    assert(page_lookup(e->env_pgdir, 0x{page:x}, NULL) ==
+           pa2page(PADDR(binary_test_{case}_start + {off})));''')
     print(f'''    printk("load_icode test for {case} passed!\\n");
 }}''')
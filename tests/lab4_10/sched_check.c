@@ -0,0 +1,90 @@
+#include <lib.h>
+
+#define NSPIN 10000000
+
+// 'wait' isn't in the library before lab 6
+static int wait_child(u_int envid) {
+	user_assert(syscall_wait(envid) == envid);
+	return env->env_wait_status;
+}
+
+// Answer every message at once.
+static void echo(void) {
+	u_int who;
+
+	for (;;) {
+		ipc_recv(&who, 0, 0);
+		ipc_send(who, 0, 0, 0);
+	}
+}
+
+// Keep the echo env 'server' busy: each of the two runs a little, then blocks.
+static void ping(u_int server) {
+	for (;;) {
+		ipc_send(server, 0, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+}
+
+// Spin in the priority class next to an IPC ping-pong pair of the same priority, which never
+// uses up a whole tick before it blocks. We must still get our share of the CPU.
+static void spin_next_to_pingpong(void) {
+	volatile u_int n;
+	int server, client;
+
+	user_assert(env->env_sched_class == ENV_SCHED_PRIO);
+	// the class is ours to pass on, but not a higher priority
+	user_assert(syscall_set_env_pri(0, env->env_pri + 1) == -E_INVAL);
+	if ((server = fork()) == 0) {
+		echo();
+	}
+	if ((client = fork()) == 0) {
+		ping(server);
+	}
+	user_assert(syscall_set_env_sched(server, ENV_SCHED_PRIO) == 0);
+	for (n = 0; n < NSPIN; n++) {
+	}
+	user_assert(syscall_env_destroy(client) == 0);
+	user_assert(syscall_env_destroy(server) == 0);
+	exit(0);
+}
+
+// Only an env the kernel allows to, like the file system server, may raise priorities and
+// classes at will. Others, even created by the kernel like us, may lower them, but not raise
+// their own or give their children more than they have.
+static void no_escalation(void) {
+	int child;
+
+	user_assert(syscall_set_env_sched(0, ENV_SCHED_FAIR) == 0);
+	user_assert(syscall_set_env_sched(0, ENV_SCHED_PRIO) == -E_INVAL);
+	user_assert(syscall_set_env_pri(0, env->env_pri + 1) == -E_INVAL);
+	if ((child = fork()) == 0) {
+		ipc_recv(0, 0, 0);
+	}
+	user_assert(envs[ENVX(child)].env_sched_class == ENV_SCHED_FAIR);
+	user_assert(syscall_set_env_sched(child, ENV_SCHED_PRIO) == -E_INVAL);
+	user_assert(syscall_set_env_pri(child, env->env_pri + 1) == -E_INVAL);
+	user_assert(syscall_set_env_pri(child, env->env_pri) == 0);
+	user_assert(syscall_env_destroy(child) == 0);
+	exit(0);
+}
+
+int main() {
+	int child;
+
+	// we're created by the kernel, so we start in the priority class, but may not raise it
+	user_assert(env->env_sched_class == ENV_SCHED_PRIO);
+	user_assert(syscall_set_env_pri(0, env->env_pri + 1) == -E_INVAL);
+	if ((child = fork()) == 0) {
+		no_escalation();
+	}
+	user_assert(wait_child(child) == 0);
+
+	if ((child = fork()) == 0) {
+		spin_next_to_pingpong();
+	}
+	// we're blocked waiting, so the spinner only shares the CPU with the ping-pong pair
+	user_assert(wait_child(child) == 0);
+	debugf("sched_check() succeeded!\n");
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include <lib.h>
+
+#define VA 0x20000000
+
+static void stat_range(u_int envid, u_int va, u_int len, struct Mem_stat *st) {
+	user_assert(syscall_mem_stat(envid, va, len, st) == 0);
+}
+
+// The kernel keeps the counts of a page table up to date as its entries change, and reads them
+// for a range that covers the whole page table. The entries of a page table partly in the
+// range are counted one by one instead. Both ways must agree.
+static int counts_agree(u_int envid) {
+	struct Mem_stat all, part;
+	u_int nresident = 0, nshared = 0, ncow = 0, nswap = 0;
+
+	stat_range(envid, 0, UTOP, &all);
+	for (u_int va = 0; va < UTOP; va += PDMAP) {
+		stat_range(envid, va, PAGE_SIZE, &part);
+		nresident += part.ms_nresident;
+		nshared += part.ms_nshared;
+		ncow += part.ms_ncow;
+		nswap += part.ms_nswap;
+		stat_range(envid, va + PAGE_SIZE, PDMAP - PAGE_SIZE, &part);
+		nresident += part.ms_nresident;
+		nshared += part.ms_nshared;
+		ncow += part.ms_ncow;
+		nswap += part.ms_nswap;
+	}
+	return all.ms_nresident == nresident && all.ms_nshared == nshared &&
+	       all.ms_ncow == ncow && all.ms_nswap == nswap;
+}
+
+int main() {
+	struct Mem_stat st;
+	int child;
+
+	// the first round may fault pages in (or copy them) while it counts
+	counts_agree(0);
+	user_assert(counts_agree(0));
+
+	user_assert(syscall_mem_alloc(0, (void *)VA, PTE_D) == 0);
+	*(volatile int *)VA = 1;
+	stat_range(0, VA, PAGE_SIZE, &st);
+	user_assert(st.ms_nresident == 1 && st.ms_nshared == 0 && st.ms_ncow == 0);
+
+	// after a fork, the page is shared copy-on-write by both of us
+	if ((child = fork()) == 0) {
+		for (;;) {
+			ipc_recv(0, 0, 0);
+		}
+	}
+	stat_range(0, VA, PAGE_SIZE, &st);
+	user_assert(st.ms_nresident == 1 && st.ms_nshared == 1 && st.ms_ncow == 1);
+	stat_range(child, VA, PAGE_SIZE, &st);
+	user_assert(st.ms_nresident == 1 && st.ms_nshared == 1 && st.ms_ncow == 1);
+
+	// once we write to it, the page of the child isn't shared any more, though the child's own
+	// mapping didn't change
+	*(volatile int *)VA = 2;
+	stat_range(0, VA, PAGE_SIZE, &st);
+	user_assert(st.ms_nresident == 1 && st.ms_nshared == 0 && st.ms_ncow == 0);
+	stat_range(child, VA, PAGE_SIZE, &st);
+	user_assert(st.ms_nresident == 1 && st.ms_nshared == 0 && st.ms_ncow == 1);
+	user_assert(counts_agree(child));
+
+	// nor are the pages we shared with it once it's gone
+	user_assert(syscall_env_destroy(child) == 0);
+	counts_agree(0);
+	user_assert(counts_agree(0));
+	debugf("mem_stat_check() succeeded!\n");
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include <lib.h>
+
+#define NPAGE 16
+#define BASE 0x10000000
+
+static char *page(int i) {
+	return (char *)(BASE + i * PAGE_SIZE);
+}
+
+static u_int page_pa(int i) {
+	return PTE_ADDR(vpt[VPN(BASE + i * PAGE_SIZE)]);
+}
+
+static struct Ksm_info wait_for_scanner(void) {
+	struct Ksm_info info;
+
+	// the system is idle whenever the only runnable env yields
+	for (int i = 0; i < 64; i++) {
+		syscall_yield();
+	}
+	user_assert(syscall_ksm_ctl(-1, &info) == 0);
+	debugf("shared %d, sharing %d, zero %d, scanned %d\n", info.ki_shared, info.ki_sharing,
+	       info.ki_nzero, info.ki_nscan);
+	return info;
+}
+
+int main() {
+	struct Ksm_info info;
+
+	user_assert(syscall_ksm_ctl(-1, &info) == 0);
+	user_assert(info.ki_batch == 0 && info.ki_shared == 0);
+
+	// equal pages, and one page that differs from them
+	for (int i = 0; i <= NPAGE; i++) {
+		user_assert(syscall_mem_alloc(0, page(i), PTE_D) == 0);
+		for (int j = 0; j < PAGE_SIZE; j++) {
+			page(i)[j] = j % 251 + (i == NPAGE);
+		}
+	}
+	// and a page full of zeros
+	user_assert(syscall_mem_alloc(0, page(NPAGE + 1), PTE_D) == 0);
+	page(NPAGE + 1)[0] = 0;
+
+	// nothing happens while the scanner is off
+	info = wait_for_scanner();
+	user_assert(info.ki_shared == 0 && info.ki_nzero == 0 && info.ki_nscan == 0);
+
+	user_assert(syscall_ksm_ctl(256, NULL) == 0);
+	info = wait_for_scanner();
+	user_assert(info.ki_batch == 256);
+	user_assert(info.ki_shared >= 1 && info.ki_sharing - info.ki_shared >= NPAGE - 1);
+	user_assert(info.ki_nzero >= 1);
+	for (int i = 1; i < NPAGE; i++) {
+		user_assert(page_pa(i) == page_pa(0));
+		user_assert(!(vpt[VPN(page(i))] & PTE_D));
+	}
+	user_assert(page_pa(NPAGE) != page_pa(0));
+	user_assert(page(NPAGE + 1)[0] == 0 && page(NPAGE + 1)[PAGE_SIZE - 1] == 0);
+
+	// a write to a merged page gets a copy of its own
+	page(3)[0] = 'x';
+	user_assert(page_pa(3) != page_pa(0));
+	user_assert(page(3)[0] == 'x' && page(3)[1] == 1);
+	for (int i = 0; i < NPAGE; i++) {
+		user_assert(i == 3 || page(i)[0] == 0);
+	}
+	page(NPAGE + 1)[0] = 'y';
+	user_assert(page(NPAGE + 1)[0] == 'y' && page(NPAGE + 1)[1] == 0);
+
+	user_assert(syscall_ksm_ctl(0, NULL) == 0);
+	debugf("ksm_check() succeeded!\n");
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include <lib.h>
+
+#define BASE 0x10000000
+#define HEAP 0x20000000
+
+static char *page = (char *)BASE;
+
+static u_int page_pa(void) {
+	return PTE_ADDR(vpt[VPN(BASE)]);
+}
+
+// 'wait' isn't in the library before lab 6
+static int wait_child(u_int envid) {
+	user_assert(syscall_wait(envid) == envid);
+	return env->env_wait_status;
+}
+
+int main() {
+	u_int pa;
+	int child;
+
+	user_assert(syscall_mem_alloc(0, page, PTE_D) == 0);
+	strcpy(page, "parent");
+	pa = page_pa();
+
+	// the child shares the page copy-on-write, and a write gets it a copy of its own
+	if ((child = fork()) == 0) {
+		user_assert(vpt[VPN(BASE)] & PTE_COW);
+		user_assert(page_pa() == pa);
+		strcpy(page, "child");
+		user_assert(!(vpt[VPN(BASE)] & PTE_COW) && (vpt[VPN(BASE)] & PTE_D));
+		user_assert(page_pa() != pa);
+		exit(0);
+	}
+	user_assert(child > 0);
+	user_assert(vpt[VPN(BASE)] & PTE_COW);
+	user_assert(wait_child(child) == 0);
+	user_assert(strcmp(page, "parent") == 0);
+
+	// with the child gone, a write takes the page back without copying it
+	page[0] = 'P';
+	user_assert(page_pa() == pa);
+	user_assert(!(vpt[VPN(BASE)] & PTE_COW) && (vpt[VPN(BASE)] & PTE_D));
+
+	// a child that can't get a copy for lack of memory is destroyed, and only it
+	if ((child = fork()) == 0) {
+		u_long va = HEAP;
+		while (syscall_mem_alloc(0, (void *)va, PTE_D) == 0) {
+			va += PAGE_SIZE;
+		}
+		debugf("out of memory after %d pages\n", (va - HEAP) / PAGE_SIZE);
+		page[0] = 'c';
+		// not reached: a destroyed env exits with status 0
+		exit(1);
+	}
+	user_assert(child > 0);
+	user_assert(wait_child(child) == 0);
+	user_assert(strcmp(page, "Parent") == 0);
+	user_assert(syscall_mem_alloc(0, (void *)HEAP, PTE_D) == 0);
+
+	debugf("cow_check() succeeded!\n");
+	return 0;
+}
@@ -113,6 +113,48 @@ void test_mode(char *pth) {
 	debugf("pass permission test with file=%s\n", pth);
 }
 
+void test_mmap(char *pth) {
+	int r, fdnum;
+	char *p, buf[16];
+
+	if ((r = open(pth, O_RDWR)) < 0 || r != 0) {
+		user_panic("cannot open %s for mmap: %d", pth, r);
+	}
+	fdnum = r;
+	p = fd2data(num2fd(fdnum));
+	if ((vpd[PDX(p)] & PTE_V) && (vpt[VPN(p)] & PTE_V)) {
+		user_panic("file content mapped by open");
+	}
+
+	if ((r = mmap(fdnum, 0, 16, (void **)&p)) < 0) {
+		user_panic("mmap: %d", r);
+	}
+	if ((r = mmap(fdnum, 0, MAXFILESIZE, (void **)&p)) != -E_INVAL) {
+		user_panic("mmap past the end of the file: %d", r);
+	}
+	// the first touch maps the page
+	if (p[0] != 'c') {
+		user_panic("wrong content through mmap: %c", p[0]);
+	}
+	p[0] = 'm';
+	if ((r = munmap(p, 16)) < 0) {
+		user_panic("munmap: %d", r);
+	}
+	if ((vpd[PDX(p)] & PTE_V) && (vpt[VPN(p)] & PTE_V)) {
+		user_panic("munmap left the page mapped");
+	}
+	close(fdnum);
+
+	if ((fdnum = open(pth, O_RDONLY)) < 0) {
+		user_panic("cannot open %s: %d", pth, fdnum);
+	}
+	if ((r = read(fdnum, buf, 1)) != 1 || buf[0] != 'm') {
+		user_panic("write through mmap lost: %d %c", r, buf[0]);
+	}
+	close(fdnum);
+	debugf("pass mmap test with file=%s\n", pth);
+}
+
 void test_remove(char *pth) {
 	int r, fdnum;
 
@@ -175,6 +217,10 @@ int main() {
 		test_mode(files[i]);
 	}
 
+	for (i = 0; i < 4; i++) {
+		test_mmap(files[i]);
+	}
+
 	for (i = 0; i < 4; i++) {
 		test_remove(files[i]);
 	}
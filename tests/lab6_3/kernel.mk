@@ -0,0 +1 @@
+init-envs += swap_fs_check /fs_serv
@@ -0,0 +1,108 @@
+#include <elf.h>
+#include <lib.h>
+
+#define HEAP 0x20000000
+#define HEAP_END 0x40000000
+#define NFREE_SWAP 256
+#define NFREE_MEM 32
+
+static char *files[] = {"/sh.b", "/ls.b", "/cat.b", "/num.b", "/echo.b", "/init.b"};
+static char buf[PAGE_SIZE];
+
+// Take all the memory and swap space there is, then give back a little of both, so that the
+// file system server has to work with pages swapped out for it while we read the files.
+static void hog(void) {
+	u_int va, nswap = 0, nmem = 0;
+
+	for (va = HEAP; va < HEAP_END; va += PAGE_SIZE) {
+		if (syscall_mem_alloc(0, (void *)va, PTE_D) < 0) {
+			break;
+		}
+		*(u_int *)va = va;
+	}
+	user_assert(va > HEAP && va < HEAP_END);
+	for (va = HEAP; va < HEAP_END && (nswap < NFREE_SWAP || nmem < NFREE_MEM);
+	     va += PAGE_SIZE) {
+		if (!(vpd[PDX(va)] & PTE_V)) {
+			continue;
+		}
+		if (PTE_IS_SWAP(vpt[VPN(va)]) && nswap < NFREE_SWAP) {
+			nswap++;
+		} else if ((vpt[VPN(va)] & PTE_V) && nmem < NFREE_MEM) {
+			nmem++;
+		} else {
+			continue;
+		}
+		user_assert(syscall_mem_unmap(0, (void *)va) == 0);
+	}
+	debugf("hog: %d pages swapped out\n", nswap);
+	user_assert(nswap > 0);
+	ipc_send(env->env_parent_id, 0, 0, 0);
+	for (;;) {
+		ipc_recv(0, 0, 0);
+	}
+}
+
+// Touch new pages with no memory or swap space left to back them: we must be destroyed, while
+// the others go on.
+static void touch(void) {
+	for (u_int va = HEAP; va < HEAP_END; va += PAGE_SIZE) {
+		*(u_int *)va = va;
+	}
+	exit(1);
+}
+
+// Getting to the IDE disk doesn't make us the file system server: we may not revoke pages.
+static void no_revoke(void) {
+	u_char status;
+
+	user_assert(syscall_read_dev(&status, 0x180001f7, 1) == 0);
+	buf[0] = 0;
+	user_assert(syscall_mem_revoke(buf) == -E_BAD_ENV);
+	exit(2);
+}
+
+static void read_file(char *path) {
+	struct Stat st;
+	u_int size = 0;
+	int fd, n;
+
+	user_assert(stat(path, &st) == 0);
+	user_assert((fd = open(path, O_RDONLY)) >= 0);
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (size == 0) {
+			user_assert(n >= 4 && buf[0] == ELFMAG0 && buf[1] == ELFMAG1 &&
+				    buf[2] == ELFMAG2 && buf[3] == ELFMAG3);
+		}
+		size += n;
+	}
+	user_assert(n == 0 && size == st.st_size);
+	close(fd);
+	debugf("read %s (%d bytes)\n", path, size);
+}
+
+int main() {
+	int child, toucher, r;
+
+	// the file system server isn't swapped out, even before it first gets to the disk
+	if ((child = fork()) == 0) {
+		hog();
+	}
+	ipc_recv(0, 0, 0);
+	for (int i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		read_file(files[i]);
+	}
+	if ((toucher = fork()) == 0) {
+		touch();
+	}
+	// an env destroyed by the kernel exits with status 0
+	user_assert(wait(toucher) == 0);
+	read_file(files[0]);
+	if ((r = fork()) == 0) {
+		no_revoke();
+	}
+	user_assert(wait(r) == 2);
+	user_assert(syscall_env_destroy(child) == 0);
+	debugf("swap_fs_check() succeeded!\n");
+	return 0;
+}
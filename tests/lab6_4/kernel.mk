@@ -0,0 +1 @@
+init-envs += template_check /fs_serv
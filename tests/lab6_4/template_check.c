@@ -0,0 +1,33 @@
+#include <lib.h>
+
+static int ntemplates(u_int parent) {
+	int n = 0;
+
+	for (int i = 0; i < NENV; i++) {
+		if (envs[i].env_status != ENV_FREE && envs[i].env_template &&
+		    envs[i].env_parent_id == parent) {
+			n++;
+		}
+	}
+	return n;
+}
+
+int main() {
+	char *argv[] = {"echo", "template", 0};
+	int child, r;
+
+	if ((child = fork()) == 0) {
+		user_assert(spawn_template("/echo.b") == 0);
+		user_assert(spawn_template("/num.b") == 0);
+		user_assert(ntemplates(env->env_id) == 2);
+		// a clone of the template runs like a spawned program
+		user_assert((r = spawn("/echo.b", argv)) >= 0);
+		user_assert(wait(r) == 0);
+		exit(0);
+	}
+	user_assert(wait(child) == 0);
+	// the templates went away with the child that made them
+	user_assert(ntemplates(child) == 0);
+	debugf("template_check() succeeded!\n");
+	return 0;
+}
@@ -0,0 +1 @@
+init-envs += wait_check /fs_serv
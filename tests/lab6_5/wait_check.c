@@ -0,0 +1,62 @@
+#include <lib.h>
+
+// Exit with 'status' once our parent is blocked, so that it really waits for us.
+static void exit_when_waited(int status) {
+	while (envs[ENVX(env->env_parent_id)].env_status != ENV_NOT_RUNNABLE) {
+		syscall_yield();
+	}
+	exit(status);
+}
+
+static int template_of(u_int parent) {
+	for (int i = 0; i < NENV; i++) {
+		if (envs[i].env_status != ENV_FREE && envs[i].env_template &&
+		    envs[i].env_parent_id == parent) {
+			return envs[i].env_id;
+		}
+	}
+	return 0;
+}
+
+int main() {
+	int child, status, tmpl;
+
+	// no child to wait for
+	user_assert(wait_any(&status) == -E_BAD_ENV);
+
+	// a child that exited before we wait
+	if ((child = fork()) == 0) {
+		exit(3);
+	}
+	while (envs[ENVX(child)].env_id == child && envs[ENVX(child)].env_status != ENV_FREE) {
+		syscall_yield();
+	}
+	user_assert(wait_any(&status) == child);
+	user_assert(status == 3);
+	user_assert(wait(child) == -E_BAD_ENV);
+	user_assert(wait_any(&status) == -E_BAD_ENV);
+
+	// a child still running, by envid and by any
+	if ((child = fork()) == 0) {
+		exit_when_waited(4);
+	}
+	user_assert(wait(child) == 4);
+	if ((child = fork()) == 0) {
+		exit_when_waited(5);
+	}
+	user_assert(wait_any(&status) == child);
+	user_assert(status == 5);
+
+	// a template never exits, so it isn't waited for
+	user_assert(spawn_template("/echo.b") == 0);
+	user_assert((tmpl = template_of(env->env_id)) != 0);
+	user_assert(wait_any(&status) == -E_BAD_ENV);
+	user_assert(wait(tmpl) == -E_BAD_ENV);
+	if ((child = fork()) == 0) {
+		exit_when_waited(6);
+	}
+	user_assert(wait_any(&status) == child);
+	user_assert(status == 6);
+	debugf("wait_check() succeeded!\n");
+	return 0;
+}
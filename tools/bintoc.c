@@ -68,7 +68,7 @@ int main(int argc, char *args[]) {
 	assert(n == size);
 	fprintf(out,
 		"unsigned int binary_%s_%s_size = %d;\n"
-		"unsigned char binary_%s_%s_start[] = {",
+		"unsigned char binary_%s_%s_start[] __attribute__((aligned(4096))) = {",
 		prefix, bin_file, size, prefix, bin_file);
 	for (i = 0; i < size; i++) {
 		fprintf(out, "0x%x%c", binary[i], i < size - 1 ? ',' : '}');
@@ -0,0 +1,37 @@
+#include <lib.h>
+
+#define KB(n) ((n) * (PAGE_SIZE / 1024))
+
+int main(int argc, char **argv) {
+    struct Mem_stat st, fs;
+    int i, r;
+
+    // 文件系统服务进程由内核创建并标记（env_fs），它把磁盘块缓存在 [DISKMAP, DISKMAP + DISKMAX)
+    for (i = 0; i < NENV; i++) {
+        if (envs[i].env_status != ENV_FREE && envs[i].env_fs) {
+            break;
+        }
+    }
+    if (i == NENV) {
+        printf("free: no file system server\n");
+        return 1;
+    }
+    if ((r = syscall_mem_stat(envs[i].env_id, DISKMAP, DISKMAX, &fs)) < 0) {
+        printf("free: %d\n", r);
+        return 1;
+    }
+    if ((r = syscall_mem_stat(0, 0, UTOP, &st)) < 0) {
+        printf("free: %d\n", r);
+        return 1;
+    }
+
+    printf("        %10s %10s %10s\n", "total", "used", "free");
+    printf("Mem:    %10d %10d %10d KiB\n", KB(st.ms_npage), KB(st.ms_npage - st.ms_nfree),
+           KB(st.ms_nfree));
+    printf("highmem:    %d KiB\n", KB(st.ms_nhighmem));
+    printf("zeroed:     %d KiB\n", KB(st.ms_nzero));
+    printf("pgtables:   %d KiB\n", KB(st.ms_npgtable));
+    printf("kmalloc:    %d KiB\n", KB(st.ms_nkmalloc));
+    printf("fs cache:   %d KiB\n", KB(fs.ms_nresident));
+    return 0;
+}
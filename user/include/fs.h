@@ -23,6 +23,13 @@
 
 #define FILE_STRUCT_SIZE 256
 
+/* Disk block n, when in memory, is mapped into the file system
+ * server's address space at DISKMAP+(n*BLOCK_SIZE). */
+#define DISKMAP 0x10000000
+
+/* Maximum disk size we can handle (1GB) */
+#define DISKMAX 0x40000000
+
 struct File {
 	char f_name[MAXNAMELEN]; // filename
 	uint32_t f_size;	 // file size in bytes
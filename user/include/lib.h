@@ -1,6 +1,7 @@
 #ifndef LIB_H
 #define LIB_H
 #include <args.h>
+#include <elf.h>
 #include <env.h>
 #include <fd.h>
 #include <mmu.h>
@@ -41,6 +42,7 @@ void _user_halt(const char *, int, const char *, ...) __attribute__((noreturn));
 /// fork, spawn
 int spawn(char *prog, char **argv);
 int spawnl(char *prot, char *args, ...);
+int spawn_template(char *prog);
 int fork(void);
 
 /// syscalls
@@ -55,16 +57,32 @@ int syscall_set_tlb_mod_entry(u_int envid, void (*func)(struct Trapframe *));
 int syscall_mem_alloc(u_int envid, void *va, u_int perm);
 int syscall_mem_map(u_int srcid, void *srcva, u_int dstid, void *dstva, u_int perm);
 int syscall_mem_unmap(u_int envid, void *va);
+int syscall_mem_revoke(void *va);
+int syscall_ksm_ctl(int batch, struct Ksm_info *info);
+int syscall_mem_stat(u_int envid, u_int va, u_int len, struct Mem_stat *st);
+int syscall_mem_batch(struct Mem_op *ops, u_int nops);
+int syscall_lazy_seg(u_int envid, const Elf32_Phdr *ph, const void *bin);
+int syscall_env_template(u_int envid);
+int syscall_env_clone(u_int tmplid);
+int syscall_set_pgfault_entry(u_int envid, void (*func)(struct Trapframe *), u_int lo, u_int hi);
 
 __attribute__((always_inline)) inline static int syscall_exofork(void) {
 	return msyscall(SYS_exofork, 0, 0, 0, 0, 0);
 }
 
+__attribute__((always_inline)) inline static int syscall_fork(void) {
+	return msyscall(SYS_fork, 0, 0, 0, 0, 0);
+}
+
 int syscall_set_env_status(u_int envid, u_int status);
+int syscall_set_env_pri(u_int envid, u_int pri);
+int syscall_set_env_sched(u_int envid, u_int class);
 int syscall_set_trapframe(u_int envid, struct Trapframe *tf);
 void syscall_panic(const char *msg) __attribute__((noreturn));
 int syscall_ipc_try_send(u_int envid, u_int value, const void *srcva, u_int perm);
 int syscall_ipc_recv(void *dstva);
+int syscall_ipc_call(u_int envid, u_int value, const void *srcva, u_int perm, void *dstva);
+int syscall_wait(u_int envid);
 int syscall_cgetc(void);
 int syscall_write_dev(void *va, u_int dev, u_int len);
 int syscall_read_dev(void *va, u_int dev, u_int len);
@@ -72,9 +90,12 @@ int syscall_read_dev(void *va, u_int dev, u_int len);
 // ipc.c
 void ipc_send(u_int whom, u_int val, const void *srcva, u_int perm);
 u_int ipc_recv(u_int *whom, void *dstva, u_int *perm);
+u_int ipc_call(u_int whom, u_int val, const void *srcva, u_int perm, void *dstva,
+	       u_int *dstperm);
 
 // wait.c
 int wait(u_int envid);
+int wait_any(int *status);
 
 // console.c
 int opencons(void);
@@ -115,6 +136,9 @@ int stat(const char *path, struct Stat *);
 // file.c
 int open(const char *path, int mode);
 int read_map(int fd, u_int offset, void **blk);
+int mmap(int fd, u_int offset, u_int len, void **pva);
+int munmap(void *va, u_int len);
+void file_pgfault(struct Trapframe *tf);
 int remove(const char *path);
 int ftruncate(int fd, u_int size);
 int sync(void);
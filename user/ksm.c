@@ -0,0 +1,41 @@
+#include <lib.h>
+
+#define KSM_DEFAULT_BATCH 64
+
+int main(int argc, char **argv) {
+    struct Ksm_info info;
+    int batch = -1;
+
+    if (argc >= 2) {
+        if (strcmp(argv[1], "on") == 0) {
+            batch = KSM_DEFAULT_BATCH;
+            // 可选的第二个参数：每次空闲时扫描的页数
+            if (argc >= 3) {
+                batch = 0;
+                for (char *p = argv[2]; *p >= '0' && *p <= '9'; p++) {
+                    batch = batch * 10 + (*p - '0');
+                }
+            }
+        } else if (strcmp(argv[1], "off") == 0) {
+            batch = 0;
+        } else {
+            printf("Usage: ksm [on [pages] | off]\n");
+            return 1;
+        }
+    }
+
+    int r = syscall_ksm_ctl(batch, &info);
+    if (r < 0) {
+        printf("ksm: %d\n", r);
+        return 1;
+    }
+    printf("scanner: %s", info.ki_batch ? "on" : "off");
+    if (info.ki_batch) {
+        printf(" (%d pages when idle)", info.ki_batch);
+    }
+    printf(", %d pages scanned\n", info.ki_nscan);
+    printf("merged:  %d pages shared by %d mappings\n", info.ki_shared, info.ki_sharing);
+    printf("zero:    %d pages replaced by the zero page\n", info.ki_nzero);
+    printf("saved:   %d pages\n", info.ki_sharing - info.ki_shared + info.ki_nzero);
+    return 0;
+}
@@ -123,12 +123,11 @@ void close_all(void) {
  * Hint:
  *   Use 'fd_lookup' or 'INDEX2FD' to get 'fd' to 'fdnum'.
  *   Use 'fd2data' to get the data address to 'fd'.
- *   Use 'syscall_mem_map' to share the data pages.
+ *   Use 'syscall_mem_batch' to share the data pages.
  */
 int dup(int oldfdnum, int newfdnum) {
-	int i, r;
+	int r;
 	void *ova, *nva;
-	u_int pte;
 	struct Fd *oldfd, *newfd;
 
 	/* Step 1: Check if 'oldnum' is valid. if not, return an error code, or get 'fd'. */
@@ -144,23 +143,24 @@ int dup(int oldfdnum, int newfdnum) {
 	ova = fd2data(oldfd);
 	nva = fd2data(newfd);
 	/* Step 5: Dunplicate the data and 'fd' self from old to new. */
-
-	if (vpd[PDX(ova)]) {
-		for (i = 0; i < PDMAP; i += PTMAP) {
-			pte = vpt[VPN(ova + i)];
-
-			if (pte & PTE_V) {
-				// should be no error here -- pd is already allocated
-				if ((r = syscall_mem_map(0, (void *)(ova + i), 0, (void *)(nva + i),
-							 pte & (PTE_D | PTE_LIBRARY))) < 0) {
-					goto err;
-				}
-			}
-		}
-	}
-
-	if ((r = syscall_mem_map(0, oldfd, 0, newfd, vpt[VPN(oldfd)] & (PTE_D | PTE_LIBRARY))) <
-	    0) {
+	/* Hint: Both are shared with their own 'PTE_D' and 'PTE_LIBRARY' bits, in a single trap. */
+	struct Mem_op ops[2] = {
+	    {
+		.mo_op = MEM_OP_MAP | MEM_OP_SKIP | MEM_OP_KEEP,
+		.mo_srcva = (u_int)ova,
+		.mo_dstva = (u_int)nva,
+		.mo_perm = PTE_D | PTE_LIBRARY,
+		.mo_npage = vpd[PDX(ova)] ? PDMAP / PTMAP : 0,
+	    },
+	    {
+		.mo_op = MEM_OP_MAP | MEM_OP_KEEP,
+		.mo_srcva = (u_int)oldfd,
+		.mo_dstva = (u_int)newfd,
+		.mo_perm = PTE_D | PTE_LIBRARY,
+		.mo_npage = 1,
+	    },
+	};
+	if ((r = syscall_mem_batch(ops, 2)) < 0) {
 		goto err;
 	}
 
@@ -168,11 +168,10 @@ int dup(int oldfdnum, int newfdnum) {
 
 err:
 	/* If error occurs, cancel all map operations. */
-	panic_on(syscall_mem_unmap(0, newfd));
-
-	for (i = 0; i < PDMAP; i += PTMAP) {
-		panic_on(syscall_mem_unmap(0, (void *)(nva + i)));
-	}
+	ops[0] = (struct Mem_op){.mo_op = MEM_OP_UNMAP, .mo_dstva = (u_int)newfd, .mo_npage = 1};
+	ops[1] = (struct Mem_op){
+	    .mo_op = MEM_OP_UNMAP, .mo_dstva = (u_int)nva, .mo_npage = PDMAP / PTMAP};
+	panic_on(syscall_mem_batch(ops, 2));
 
 	return r;
 }
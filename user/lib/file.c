@@ -20,6 +20,53 @@ struct Dev devfile = {
     .dev_stat = file_stat,
 };
 
+// Overview:
+//  Tell whether the page at 'va' is mapped.
+static int file_page_mapped(void *va) {
+	return (vpd[PDX(va)] & PTE_V) && (vpt[VPN(va)] & PTE_V);
+}
+
+// Overview:
+//  Find the open file whose data region holds 'va', and the offset of 'va' in it.
+//
+// Returns:
+//  0 on success, -E_INVAL if 'va' isn't in the data region of an open file.
+static int file_of_va(u_int va, struct Filefd **pffd, u_int *poffset) {
+	struct Fd *fd;
+
+	if (va < FILEBASE || va >= INDEX2DATA(MAXFD)) {
+		return -E_INVAL;
+	}
+	if (fd_lookup((va - FILEBASE) / PDMAP, &fd) < 0 || fd->fd_dev_id != devfile.dev_id) {
+		return -E_INVAL;
+	}
+	*pffd = (struct Filefd *)fd;
+	*poffset = va - (u_int)fd2data(fd);
+	return 0;
+}
+
+// Overview:
+//  The page fault handler of the file data regions, registered by 'libmain'. Map the page of
+//  the file at the faulting address from the file server, then resume the faulting context.
+void file_pgfault(struct Trapframe *tf) {
+	struct Filefd *ffd;
+	u_int va = ROUNDDOWN(tf->cp0_badvaddr, PTMAP);
+	u_int offset;
+	int r;
+
+	if (file_of_va(va, &ffd, &offset) < 0) {
+		user_panic("page fault at %x: not in an open file", tf->cp0_badvaddr);
+	}
+	if (offset >= ROUND(ffd->f_file.f_size, PTMAP)) {
+		user_panic("page fault at %x: past the end of the file", tf->cp0_badvaddr);
+	}
+	if ((r = fsipc_map(ffd->f_fileid, offset, (void *)va)) < 0) {
+		user_panic("page fault at %x: fsipc_map: %d", tf->cp0_badvaddr, r);
+	}
+	r = syscall_set_trapframe(0, tf);
+	user_panic("file_pgfault: syscall_set_trapframe returned %d", r);
+}
+
 // Overview:
 //  Open a file (or directory).
 //
@@ -47,18 +94,8 @@ int open(const char *path, int mode) {
         return r;
     }
 
-    // Step 4: Map the file content.
-    char *va = fd2data(fd);
-    struct Filefd *ffd = (struct Filefd *)fd;
-    u_int size = ffd->f_file.f_size;
-    u_int fileid = ffd->f_fileid;
-
-    for (int i = 0; i < size; i += PTMAP) {
-        if ((r = fsipc_map(fileid, i, va + i)) < 0) {
-            close(fd2num(fd)); // 如果失败，关闭并回收fd
-            return r;
-        }
-    }
+    // Step 4: The file content is not mapped here: each page is mapped by 'file_pgfault'
+    // when it's first touched.
 
     // Step 5: Return the number of file descriptor.
     return fd2num(fd);
@@ -80,8 +117,11 @@ int file_close(struct Fd *fd) {
 	// Set the start address storing the file's content.
 	va = fd2data(fd);
 
-	// Tell the file server the dirty page.
+	// Tell the file server the dirty page. Pages never mapped weren't written to.
 	for (i = 0; i < size; i += PTMAP) {
+		if (!file_page_mapped(va + i)) {
+			continue;
+		}
 		if ((r = fsipc_dirty(fileid, i)) < 0) {
 			debugf("cannot mark pages as dirty\n");
 			return r;
@@ -98,11 +138,11 @@ int file_close(struct Fd *fd) {
 	if (size == 0) {
 		return 0;
 	}
-	for (i = 0; i < size; i += PTMAP) {
-		if ((r = syscall_mem_unmap(0, (void *)(va + i))) < 0) {
-			debugf("cannont unmap the file\n");
-			return r;
-		}
+	struct Mem_op op = {
+	    .mo_op = MEM_OP_UNMAP, .mo_dstva = (u_int)va, .mo_npage = ROUND(size, PTMAP) / PTMAP};
+	if ((r = syscall_mem_batch(&op, 1)) < 0) {
+		debugf("cannont unmap the file\n");
+		return r;
 	}
 	return 0;
 }
@@ -153,14 +193,85 @@ int read_map(int fdnum, u_int offset, void **blk) {
 		return -E_NO_DISK;
 	}
 
-	if (!(vpd[PDX(va)] & PTE_V) || !(vpt[VPN(va)] & PTE_V)) {
-		return -E_NO_DISK;
+	if (!file_page_mapped(va)) {
+		struct Filefd *ffd = (struct Filefd *)fd;
+		if (offset >= ffd->f_file.f_size) {
+			return -E_NO_DISK;
+		}
+		if ((r = fsipc_map(ffd->f_fileid, ROUNDDOWN(offset, PTMAP),
+				   (void *)ROUNDDOWN(va, PTMAP))) < 0) {
+			return r;
+		}
 	}
 
 	*blk = (void *)va;
 	return 0;
 }
 
+// Overview:
+//  Map 'len' bytes of the open file 'fdnum' from 'offset' into our address space, at '*pva'.
+//  Nothing is read now: each page is read from the file server when it's first touched, and
+//  writes go to the file.
+//
+// Returns:
+//  0 on success,
+//  -E_INVAL if 'fdnum' isn't a file or the range isn't within the file,
+//  the underlying error on other failures.
+int mmap(int fdnum, u_int offset, u_int len, void **pva) {
+	int r;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0) {
+		return r;
+	}
+	if (fd->fd_dev_id != devfile.dev_id) {
+		return -E_INVAL;
+	}
+	if (offset + len < offset || offset + len > ((struct Filefd *)fd)->f_file.f_size) {
+		return -E_INVAL;
+	}
+	*pva = fd2data(fd) + offset;
+	return 0;
+}
+
+// Overview:
+//  Undo 'mmap' for the 'len' bytes at 'va': the pages touched so far are written back to the
+//  file (when it's closed or synced) and unmapped. Touching them again maps them again.
+//
+// Returns:
+//  0 on success,
+//  -E_INVAL if the range isn't within one mapped file,
+//  the underlying error on other failures.
+int munmap(void *va, u_int len) {
+	int r;
+	struct Filefd *ffd;
+	u_int offset, end;
+
+	if (len == 0) {
+		return 0;
+	}
+	if ((r = file_of_va((u_int)va, &ffd, &offset)) < 0) {
+		return r;
+	}
+	if (offset + len < offset || offset + len > MAXFILESIZE) {
+		return -E_INVAL;
+	}
+	end = ROUND(offset + len, PTMAP);
+	va = fd2data((struct Fd *)ffd);
+	for (offset = ROUNDDOWN(offset, PTMAP); offset < end; offset += PTMAP) {
+		if (!file_page_mapped(va + offset)) {
+			continue;
+		}
+		if ((r = fsipc_dirty(ffd->f_fileid, offset)) < 0) {
+			return r;
+		}
+		if ((r = syscall_mem_unmap(0, va + offset)) < 0) {
+			return r;
+		}
+	}
+	return 0;
+}
+
 // Overview:
 //  Write 'n' bytes from 'buf' to 'fd' at the current seek position.
 static int file_write(struct Fd *fd, const void *buf, u_int n, u_int offset) {
@@ -202,7 +313,7 @@ static int file_stat(struct Fd *fd, struct Stat *st) {
 // Overview:
 //  Truncate or extend an open file to 'size' bytes
 int ftruncate(int fdnum, u_int size) {
-	int i, r;
+	int r;
 	struct Fd *fd;
 	struct Filefd *f;
 	u_int oldsize, fileid;
@@ -230,21 +341,17 @@ int ftruncate(int fdnum, u_int size) {
 
 	void *va = fd2data(fd);
 
-	// Map any new pages needed if extending the file
-	for (i = ROUND(oldsize, PTMAP); i < ROUND(size, PTMAP); i += PTMAP) {
-		if ((r = fsipc_map(fileid, i, va + i)) < 0) {
-			int _r = fsipc_set_size(fileid, oldsize);
-			if (_r < 0) {
-				return _r;
-			}
-			return r;
-		}
-	}
+	// New pages needed if extending the file are mapped by 'file_pgfault' when touched.
 
 	// Unmap pages if truncating the file
-	for (i = ROUND(size, PTMAP); i < ROUND(oldsize, PTMAP); i += PTMAP) {
-		if ((r = syscall_mem_unmap(0, (void *)(va + i))) < 0) {
-			user_panic("ftruncate: syscall_mem_unmap %08x: %d\n", va + i, r);
+	if (ROUND(size, PTMAP) < ROUND(oldsize, PTMAP)) {
+		struct Mem_op op = {
+		    .mo_op = MEM_OP_UNMAP,
+		    .mo_dstva = (u_int)va + ROUND(size, PTMAP),
+		    .mo_npage = (ROUND(oldsize, PTMAP) - ROUND(size, PTMAP)) / PTMAP,
+		};
+		if ((r = syscall_mem_batch(&op, 1)) < 0) {
+			user_panic("ftruncate: syscall_mem_batch %08x: %d\n", op.mo_dstva, r);
 		}
 	}
 
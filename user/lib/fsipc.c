@@ -20,10 +20,8 @@ u_char fsipcbuf[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
 //  0 if successful,
 //  < 0 on failure.
 static int fsipc(u_int type, void *fsreq, void *dstva, u_int *perm) {
-	u_int whom;
 	// Our file system server must be the 2nd env.
-	ipc_send(envs[1].env_id, type, fsreq, PTE_D);
-	return ipc_recv(&whom, dstva, perm);
+	return ipc_call(envs[1].env_id, type, fsreq, PTE_D, dstva, perm);
 }
 
 // Overview:
@@ -37,3 +37,21 @@ u_int ipc_recv(u_int *whom, void *dstva, u_int *perm) {
 
 	return env->env_ipc_value;
 }
+
+// Send val to whom and receive the reply, like ipc_send followed by
+// ipc_recv(0, dstva, dstperm), but whom runs right away on the rest
+// of our time slice, and so do we once it replies.
+u_int ipc_call(u_int whom, u_int val, const void *srcva, u_int perm, void *dstva,
+	       u_int *dstperm) {
+	int r;
+	while ((r = syscall_ipc_call(whom, val, srcva, perm, dstva)) == -E_IPC_NOT_RECV) {
+		syscall_yield();
+	}
+	user_assert(r == 0);
+
+	if (dstperm) {
+		*dstperm = env->env_ipc_perm;
+	}
+
+	return env->env_ipc_value;
+}
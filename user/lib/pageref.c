@@ -26,5 +26,5 @@ int pageref(void *v) {
 		return 0;
 	}
 	/* Step 3: Return the result. */
-	return pages[PPN(pte)].pp_ref;
+	return pages[PA2PPN(pte)].pp_ref;
 }
@@ -85,29 +85,31 @@ error:
 	return r;
 }
 
-static int spawn_mapper(void *data, u_long va, size_t offset, u_int perm, const void *src,
-			size_t len) {
-	u_int child_id = *(u_int *)data;
-	try(syscall_mem_alloc(child_id, (void *)va, perm));
-	if (src != NULL) {
-		int r = syscall_mem_map(child_id, (void *)va, 0, (void *)UTEMP, perm | PTE_D);
-		if (r) {
-			syscall_mem_unmap(child_id, (void *)va);
-			return r;
-		}
-		memcpy((void *)(UTEMP + offset), src, len);
-		return syscall_mem_unmap(0, (void *)UTEMP);
-	}
-	return 0;
-}
+// Templates made by 'spawn_template', cloned by 'spawn' to run the programs they were made
+// from.
+#define SPAWN_NTEMPLATE 8
 
-/* Note:
+static struct {
+	char st_path[MAXPATHLEN]; // absolute path of the program
+	u_int st_envid;		  // envid of the template
+} spawn_templates[SPAWN_NTEMPLATE];
+static u_int spawn_ntemplates;
+
+/* Overview:
+ *   Create a not runnable child with the program 'prog' loaded, starting at its entry point.
+ *   Its stack is set up by 'spawn_start'.
+ *
+ * Post-Condition:
+ *   Return 0 and set '*pchild' to the child's envid on success, or return the error with no
+ *   child left behind.
+ *
+ * Note:
  *   This function involves loading executable code to memory. After the completion of load
  *   procedures, D-cache and I-cache writeback/invalidation MUST be performed to maintain cache
  *   coherence, which MOS has NOT implemented. This may result in unexpected behaviours on real
  *   CPUs! QEMU doesn't simulate caching, allowing the OS to function correctly.
  */
-int spawn(char *prog, char **argv) {
+static int spawn_load(char *prog, u_int *pchild) {
 	// Step 1: Open the file 'prog' (the path of the program).
 	// Return the error if 'open' fails.
 	int fd;
@@ -142,14 +144,7 @@ int spawn(char *prog, char **argv) {
 		r = child;
 		goto err;
 	}
-	// Step 4: Use 'init_stack(child, argv, &sp)' to initialize the stack of the child.
-	// 'goto err1' if that fails.
-	u_int sp;
-	/* Exercise 6.4: Your code here. (3/6) */
-	if ((r = init_stack(child, argv, &sp)) < 0) {
-		goto err1;
-	}
-	// Step 5: Load the ELF segments in the file into the child's memory.
+	// Step 4: Load the ELF segments in the file into the child's memory.
 	// This is similar to 'load_icode()' in the kernel.
 	size_t ph_off;
 	ELF_FOREACH_PHDR_OFF (ph_off, ehdr) {
@@ -168,15 +163,23 @@ int spawn(char *prog, char **argv) {
 			// Read and map the ELF data in the file at 'ph->p_offset' into our memory
 			// using 'read_map()'.
 			// 'goto err1' if that fails.
+			// The file is mapped lazily, so every page of the segment is mapped here
+			// for the kernel to find it.
 			/* Exercise 6.4: Your code here. (5/6) */
+			for (u_int off = ROUNDDOWN(ph->p_offset, PAGE_SIZE);
+			     off < ph->p_offset + ph->p_filesz; off += PAGE_SIZE) {
+				if ((r = read_map(fd, off, &bin)) < 0) {
+					goto err1;
+				}
+			}
 			if ((r = read_map(fd, ph->p_offset, &bin)) < 0) {
 				goto err1;
 			}
-			// Load the segment 'ph' into the child's memory using 'elf_load_seg()'.
-			// Use 'spawn_mapper' as the callback, and '&child' as its data.
+			// Give the segment 'ph' to the child using 'syscall_lazy_seg()': its pages
+			// are filled in by the kernel when the child first touches them.
 			// 'goto err1' if that fails.
 			/* Exercise 6.4: Your code here. (6/6) */
-			if ((r = elf_load_seg(ph, bin, spawn_mapper, &child)) < 0) {
+			if ((r = syscall_lazy_seg(child, ph, bin)) < 0) {
 				goto err1;
 			}
 		}
@@ -185,46 +188,135 @@ int spawn(char *prog, char **argv) {
 
 	struct Trapframe tf = envs[ENVX(child)].env_tf;
 	tf.cp0_epc = entrypoint;
+	if ((r = syscall_set_trapframe(child, &tf)) != 0) {
+		syscall_env_destroy(child);
+		return r;
+	}
+	*pchild = child;
+	return 0;
+
+err1:
+	syscall_env_destroy(child);
+err:
+	close(fd);
+	return r;
+}
+
+/* Overview:
+ *   Give the child 'child' made by 'spawn_load' or cloned from a template its stack with
+ *   'argv', share our 'PTE_LIBRARY' pages with it, and make it runnable.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or return the error with the child destroyed.
+ */
+static int spawn_start(u_int child, char **argv) {
+	u_int sp;
+	int r;
+
+	if ((r = init_stack(child, argv, &sp)) < 0) {
+		goto err;
+	}
+	struct Trapframe tf = envs[ENVX(child)].env_tf;
 	tf.regs[29] = sp;
 	if ((r = syscall_set_trapframe(child, &tf)) != 0) {
-		goto err2;
+		goto err;
 	}
 
 	// Pages with 'PTE_LIBRARY' set are shared between the parent and the child.
+	// Each mapped page table becomes one operation of a batch, applied with a single trap.
+	struct Mem_op ops[MEM_BATCH_MAX];
+	u_int nops = 0;
 	for (u_int pdeno = 0; pdeno <= PDX(USTACKTOP); pdeno++) {
-		if (!(vpd[pdeno] & PTE_V)) {
-			continue;
+		if (vpd[pdeno] & PTE_V) {
+			u_int start = MAX(pdeno << PDSHIFT, UTEMP);
+			u_int end = MIN((pdeno + 1) << PDSHIFT, UTOP);
+			ops[nops++] = (struct Mem_op){
+			    .mo_op = MEM_OP_MAP | MEM_OP_SKIP | MEM_OP_KEEP | MEM_OP_LIBRARY,
+			    .mo_srcva = start,
+			    .mo_dstid = child,
+			    .mo_dstva = start,
+			    .mo_perm = (1 << PGSHIFT) - 1,
+			    .mo_npage = (end - start) >> PGSHIFT,
+			};
 		}
-		for (u_int pteno = 0; pteno <= PTX(~0); pteno++) {
-			u_int pn = (pdeno << 10) + pteno;
-			u_int perm = vpt[pn] & ((1 << PGSHIFT) - 1);
-			if ((perm & PTE_V) && (perm & PTE_LIBRARY)) {
-				void *va = (void *)(pn << PGSHIFT);
-
-				if ((r = syscall_mem_map(0, va, child, va, perm)) < 0) {
-					debugf("spawn: syscall_mem_map %x %x: %d\n", va, child, r);
-					goto err2;
-				}
+		if (nops > 0 && (nops == MEM_BATCH_MAX || pdeno == PDX(USTACKTOP))) {
+			if ((r = syscall_mem_batch(ops, nops)) < 0) {
+				debugf("spawn: syscall_mem_batch %x: %d\n", child, r);
+				goto err;
 			}
+			nops = 0;
 		}
 	}
 
 	if ((r = syscall_set_env_status(child, ENV_RUNNABLE)) < 0) {
 		debugf("spawn: syscall_set_env_status %x: %d\n", child, r);
-		goto err2;
+		goto err;
 	}
-	return child;
+	return 0;
 
-err2:
-	syscall_env_destroy(child);
-	return r;
-err1:
-	syscall_env_destroy(child);
 err:
-	close(fd);
+	syscall_env_destroy(child);
 	return r;
 }
 
+/* Overview:
+ *   Make a template of the program 'prog': a frozen child with it loaded, which 'spawn' then
+ *   clones to run 'prog' instead of loading it again. The template stays around as long as
+ *   the env calling this does: the kernel destroys it when the caller exits.
+ *
+ * Post-Condition:
+ *   Return 0 on success.
+ *   Return -E_NO_MEM if there are already 'SPAWN_NTEMPLATE' templates.
+ *   Return the original error if 'prog' can't be loaded.
+ */
+int spawn_template(char *prog) {
+	u_int child;
+	int r;
+
+	if (spawn_ntemplates == SPAWN_NTEMPLATE) {
+		return -E_NO_MEM;
+	}
+	try(spawn_load(prog, &child));
+	if ((r = syscall_env_template(child)) != 0) {
+		syscall_env_destroy(child);
+		return r;
+	}
+	resolve_path(prog, spawn_templates[spawn_ntemplates].st_path);
+	spawn_templates[spawn_ntemplates++].st_envid = child;
+	return 0;
+}
+
+/* Overview:
+ *   Run the program 'prog' with the arguments 'argv' in a new env.
+ *   A template of 'prog' made by 'spawn_template' is cloned if there's one, which costs
+ *   little more than one copy-on-write address space copy. Otherwise 'prog' is loaded.
+ *
+ * Post-Condition:
+ *   Return the envid of the new env, or the error.
+ */
+int spawn(char *prog, char **argv) {
+	char path[MAXPATHLEN];
+	u_int child;
+	int r = -E_NOT_FOUND;
+
+	if (spawn_ntemplates > 0) {
+		resolve_path(prog, path);
+	}
+	for (u_int i = 0; i < spawn_ntemplates; i++) {
+		if (strcmp(spawn_templates[i].st_path, path) == 0) {
+			r = syscall_env_clone(spawn_templates[i].st_envid);
+			break;
+		}
+	}
+	if (r >= 0) {
+		child = r;
+	} else {
+		try(spawn_load(prog, &child));
+	}
+	try(spawn_start(child, argv));
+	return child;
+}
+
 int spawnl(char *prog, char *args, ...) {
 	// Thanks to MIPS calling convention, the layout of arguments on the stack
 	// are straightforward.
@@ -40,10 +40,50 @@ int syscall_mem_unmap(u_int envid, void *va) {
 	return msyscall(SYS_mem_unmap, envid, va);
 }
 
+int syscall_mem_revoke(void *va) {
+	return msyscall(SYS_mem_revoke, va);
+}
+
+int syscall_ksm_ctl(int batch, struct Ksm_info *info) {
+	return msyscall(SYS_ksm_ctl, batch, info);
+}
+
+int syscall_mem_stat(u_int envid, u_int va, u_int len, struct Mem_stat *st) {
+	return msyscall(SYS_mem_stat, envid, va, len, st);
+}
+
+int syscall_mem_batch(struct Mem_op *ops, u_int nops) {
+	return msyscall(SYS_mem_batch, ops, nops);
+}
+
+int syscall_lazy_seg(u_int envid, const Elf32_Phdr *ph, const void *bin) {
+	return msyscall(SYS_lazy_seg, envid, ph, bin);
+}
+
+int syscall_env_template(u_int envid) {
+	return msyscall(SYS_env_template, envid);
+}
+
+int syscall_env_clone(u_int tmplid) {
+	return msyscall(SYS_env_clone, tmplid);
+}
+
+int syscall_set_pgfault_entry(u_int envid, void (*func)(struct Trapframe *), u_int lo, u_int hi) {
+	return msyscall(SYS_set_pgfault_entry, envid, func, lo, hi);
+}
+
 int syscall_set_env_status(u_int envid, u_int status) {
 	return msyscall(SYS_set_env_status, envid, status);
 }
 
+int syscall_set_env_pri(u_int envid, u_int pri) {
+	return msyscall(SYS_set_env_pri, envid, pri);
+}
+
+int syscall_set_env_sched(u_int envid, u_int class) {
+	return msyscall(SYS_set_env_sched, envid, class);
+}
+
 int syscall_set_trapframe(u_int envid, struct Trapframe *tf) {
 	return msyscall(SYS_set_trapframe, envid, tf);
 }
@@ -61,6 +101,14 @@ int syscall_ipc_recv(void *dstva) {
 	return msyscall(SYS_ipc_recv, dstva);
 }
 
+int syscall_ipc_call(u_int envid, u_int value, const void *srcva, u_int perm, void *dstva) {
+	return msyscall(SYS_ipc_call, envid, value, srcva, perm, dstva);
+}
+
+int syscall_wait(u_int envid) {
+	return msyscall(SYS_wait, envid);
+}
+
 int syscall_cgetc() {
 	return msyscall(SYS_cgetc);
 }
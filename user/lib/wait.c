@@ -1,15 +1,31 @@
 #include <env.h>
 #include <lib.h>
 
+// Wait for the child envid to exit and return its exit status,
+// or -E_BAD_ENV if it isn't a child of ours (or was waited for).
 int wait(u_int envid) {
-	const volatile struct Env *e;
+	int r;
 
-	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE) {
-		syscall_yield();
+	if (envid == 0) {
+		return -E_BAD_ENV;
 	}
-	if (e->env_id == envid && e->env_status == ENV_FREE) {
-		return e->env_exit_status; // Return the saved exit status
+	if ((r = syscall_wait(envid)) < 0) {
+		return r;
 	}
-	return -E_BAD_ENV;
-}
\ No newline at end of file
+	return env->env_wait_status;
+}
+
+// Wait for any child to exit. Return its envid, and store its exit
+// status in *status if status isn't NULL. Return -E_BAD_ENV if we
+// have no child to wait for.
+int wait_any(int *status) {
+	int r;
+
+	if ((r = syscall_wait(0)) < 0) {
+		return r;
+	}
+	if (status) {
+		*status = env->env_wait_status;
+	}
+	return r;
+}
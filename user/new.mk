@@ -1,3 +1,3 @@
-USERAPPS += touch.b mkdir.b rm.b
+USERAPPS += touch.b mkdir.b rm.b ksm.b free.b ps.b
 INITAPPS +=
 USERLIB += lib/path.o
\ No newline at end of file
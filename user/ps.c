@@ -0,0 +1,26 @@
+#include <env.h>
+#include <lib.h>
+
+#define KB(n) ((n) * (PAGE_SIZE / 1024))
+
+int main(int argc, char **argv) {
+    struct Mem_stat st;
+
+    printf("   ENVID   PARENT S PRI     RUNS  CPU(Mcyc)   RSS(KiB) SHARED    COW   SWAP  PGTAB\n");
+    for (int i = 0; i < NENV; i++) {
+        const volatile struct Env *e = &envs[i];
+        u_int envid = e->env_id;
+        // 进程可能在两次读取之间退出，统计失败就跳过它
+        if (e->env_status == ENV_FREE || syscall_mem_stat(envid, 0, UTOP, &st) < 0) {
+            continue;
+        }
+        // R：可运行，S：阻塞，T：用于克隆的模板进程
+        char state = e->env_template ? 'T' : e->env_status == ENV_RUNNABLE ? 'R' : 'S';
+        // 显示实际调度用的优先级（含从等待它的进程继承来的），优先级调度类的进程在优先级后标 *
+        printf("%8x %8x %c %2d%c %8d %10d %10d %6d %6d %6d %6d\n", envid, e->env_parent_id, state,
+               MAX(e->env_pri, e->env_inh_pri), e->env_sched_class == ENV_SCHED_PRIO ? '*' : ' ', e->env_runs,
+               (u_int)(e->env_runtime >> 20), KB(st.ms_nresident), st.ms_nshared, st.ms_ncow,
+               st.ms_nswap, st.ms_nenvpgtable);
+    }
+    return 0;
+}
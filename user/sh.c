@@ -271,6 +271,8 @@ int try_spawn_and_wait(char *prog, const char **argv) {
 
     if ((r = spawn(prog, argv)) >= 0) {
         if (r == 0) return 0;
+        // 命令继承了 shell 的优先级，降回默认值，免得与 shell 争抢
+        syscall_set_env_pri(r, ENV_PRI_DEFAULT);
         return wait(r);
     }
 
@@ -278,6 +280,7 @@ int try_spawn_and_wait(char *prog, const char **argv) {
     strcat(path_with_b, ".b");
     if ((r = spawn(path_with_b, argv)) >= 0) {
         if (r == 0) return 0;
+        syscall_set_env_pri(r, ENV_PRI_DEFAULT);
         return wait(r);
     }
 
@@ -512,6 +515,9 @@ int main() {
 
     strcpy(g_cwd, "/");
 
+    // shell 的优先级 ENV_PRI_INTERACTIVE 继承自 init（进程不能提高自己的优先级），
+    // 让交互响应不被后台计算拖慢
+
     for (int i = 0; i < MAX_VARS; i++) {
         vars[i].in_use = 0;
     }
@@ -531,6 +537,12 @@ int main() {
 
     load_history();
 
+    // 常用命令预先载入为模板，之后每次执行只需复制一次地址空间
+    static char *templates[] = {"/ls.b", "/cat.b", "/echo.b"};
+    for (int i = 0; i < sizeof(templates) / sizeof(templates[0]); i++) {
+        spawn_template(templates[i]);
+    }
+
     printf("\n:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::\n");
 	printf("::               MOS Shell (Challenge Edition)             ::\n");
 	printf(":::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::\n");